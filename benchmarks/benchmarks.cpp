@@ -1,13 +1,59 @@
 #include <benchmark/benchmark.h>
 #include <metrics/registry.h>
+#include <metrics/local.h>
+#include <metrics/static_histogram.h>
 
 #include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <string>
 #include <thread>
+#include <vector>
 
 using namespace Metrics;
 
 static const size_t maxThreads = std::thread::hardware_concurrency();
 
+#ifdef _MSC_VER
+#define METRICS_NOINLINE __declspec(noinline)
+#else
+#define METRICS_NOINLINE __attribute__((noinline))
+#endif
+
+// Counts heap allocations made by the process, reported by lookup benchmarks per iteration.
+// Each block is prefixed with its size, so that bytes currently allocated can be tracked as well
+static std::atomic<uint64_t> s_allocations(0);
+static std::atomic<int64_t> s_allocatedBytes(0);
+static const size_t allocationHeader = alignof(std::max_align_t);
+
+METRICS_NOINLINE void* operator new(size_t size)
+{
+    s_allocations.fetch_add(1, std::memory_order_relaxed);
+    s_allocatedBytes.fetch_add((int64_t)size, std::memory_order_relaxed);
+    if (auto p = static_cast<char*>(std::malloc(size + allocationHeader))) {
+        *reinterpret_cast<size_t*>(p) = size;
+        return p + allocationHeader;
+    }
+    throw std::bad_alloc();
+}
+
+METRICS_NOINLINE void operator delete(void* p) noexcept
+{
+    if (p == nullptr)
+        return;
+    auto block = static_cast<char*>(p) - allocationHeader;
+    s_allocatedBytes.fetch_sub((int64_t)*reinterpret_cast<size_t*>(block), std::memory_order_relaxed);
+    std::free(block);
+}
+
+METRICS_NOINLINE void operator delete(void* p, size_t) noexcept { operator delete(p); }
+
+static void reportAllocations(benchmark::State& state, uint64_t start)
+{
+    state.counters["allocs"] = benchmark::Counter((double)(s_allocations.load() - start) / state.iterations(), benchmark::Counter::kAvgThreads);
+}
+
 static void BM_Reference_AtomicIncrement(benchmark::State& state) {
     static std::atomic<int> counter;
     for (auto _ : state)
@@ -24,6 +70,46 @@ static void BM_CounterIncrement(benchmark::State& state) {
 }
 BENCHMARK(BM_CounterIncrement)->ThreadRange(1, maxThreads)->UseRealTime();
 
+static void BM_LocalCounterIncrement(benchmark::State& state) {
+    static auto counter = Counter();
+    LocalCounter local(counter);
+    for (auto _ : state)
+        local++;
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_LocalCounterIncrement)->ThreadRange(1, maxThreads)->UseRealTime();
+
+static void BM_ShardedCounterIncrement(benchmark::State& state) {
+    static auto counter = Counter(Sharding::PerThread);
+    for (auto _ : state)
+        counter++;
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ShardedCounterIncrement)->ThreadRange(1, maxThreads)->UseRealTime();
+
+// Handle is passed by value into a function which is not inlined, as in a request handler
+template<typename THandle> METRICS_NOINLINE static void incrementHandle(THandle handle) {
+    handle++;
+}
+
+static void BM_CounterHandleCopy(benchmark::State& state) {
+    static auto registry = createRegistry();
+    auto counter = registry->getCounter("handle_copy");
+    for (auto _ : state)
+        incrementHandle(counter);
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CounterHandleCopy)->ThreadRange(1, maxThreads)->UseRealTime();
+
+static void BM_CounterRefCopy(benchmark::State& state) {
+    static auto registry = createRegistry();
+    auto counter = registry->getCounterRef("handle_copy");
+    for (auto _ : state)
+        incrementHandle(counter);
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CounterRefCopy)->ThreadRange(1, maxThreads)->UseRealTime();
+
 static void BM_GaugeSet(benchmark::State& state) {
     static auto gauge = Gauge();
     for (auto _ : state)
@@ -39,11 +125,21 @@ static void BM_GaugeIncrement(benchmark::State& state) {
 }
 BENCHMARK(BM_GaugeIncrement)->ThreadRange(1, maxThreads)->UseRealTime();
 
+static void BM_UpDownGaugeIncrement(benchmark::State& state) {
+    static auto plain = Gauge(GaugeKind::UpDown);
+    static auto sharded = Gauge(GaugeKind::UpDown, Sharding::PerThread);
+    auto& gauge = state.range(0) ? sharded : plain;
+    for (auto _ : state)
+        gauge += 1;
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_UpDownGaugeIncrement)->ArgName("sharded")->Arg(0)->Arg(1)->ThreadRange(1, maxThreads)->UseRealTime();
+
 static void BM_HistogramObserve(benchmark::State& state) {
     static std::shared_ptr<IHistogram> histogram;
+    int nBuckets = state.range(0);
 
     if (state.thread_index() == 0) {
-        int nBuckets = state.range(0);
         std::vector<double> buckets;
         buckets.reserve(nBuckets);
 
@@ -53,12 +149,127 @@ static void BM_HistogramObserve(benchmark::State& state) {
         histogram = makeHistogram(buckets);
     }
 
+    // Values spread over all buckets, so that search depth varies between observations
+    std::vector<double> values;
+    for (int i = 0; i < 64; i++)
+        values.push_back((i * 37) % (nBuckets + 1) + 0.5);
+
+    size_t i = 0;
     for (auto _ : state)
-        histogram->observe(5);
+        histogram->observe(values[i++ & 63]);
 
     state.SetItemsProcessed(histogram->count());
 }
-BENCHMARK(BM_HistogramObserve)->Range(2, 5)->ThreadRange(1, maxThreads)->UseRealTime();
+BENCHMARK(BM_HistogramObserve)->Arg(2)->Arg(5)->Arg(10)->Arg(30)->Arg(100)->ThreadRange(1, maxThreads)->UseRealTime();
+
+static void BM_StaticHistogramObserve(benchmark::State& state) {
+    static StaticHistogram<std::ratio<1>, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10> histogram;
+
+    // Same values and bounds as BM_HistogramObserve/10
+    std::vector<double> values;
+    for (int i = 0; i < 64; i++)
+        values.push_back((i * 37) % 11 + 0.5);
+
+    size_t i = 0;
+    for (auto _ : state)
+        histogram.observe(values[i++ & 63]);
+
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_StaticHistogramObserve)->ThreadRange(1, maxThreads)->UseRealTime();
+
+static void BM_HistogramObserveBuckets(benchmark::State& state) {
+    static std::shared_ptr<IHistogram> histogram;
+
+    // Same 100 linear bounds, either searched or computed arithmetically
+    if (state.thread_index() == 0) {
+        auto linear = makeLinearBuckets(1., 1., 100);
+        histogram = makeHistogram(state.range(0) ? linear : makeBuckets(linear->bounds()));
+    }
+
+    std::vector<double> values;
+    for (int i = 0; i < 64; i++)
+        values.push_back((i * 37) % 101 + 0.5);
+
+    size_t i = 0;
+    for (auto _ : state)
+        histogram->observe(values[i++ & 63]);
+
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_HistogramObserveBuckets)->ArgName("linear")->Arg(0)->Arg(1)->ThreadRange(1, maxThreads)->UseRealTime();
+
+static void BM_HistogramObserveValues(benchmark::State& state) {
+    static std::shared_ptr<IHistogram> histogram;
+
+    if (state.thread_index() == 0)
+        histogram = makeHistogram({ 1., 2., 5., 10., 20., 50., 100. }, state.range(0) ? Sharding::PerThread : Sharding::None);
+
+    // Latency-like spread of values hitting all buckets
+    std::vector<double> values;
+    for (int i = 0; i < 64; i++)
+        values.push_back((i * 37 + state.thread_index()) % 128);
+
+    size_t i = 0;
+    for (auto _ : state)
+        histogram->observe(values[i++ & 63]);
+
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_HistogramObserveValues)->ArgName("sharded")->Arg(0)->Arg(1)->ThreadRange(1, maxThreads)->UseRealTime();
+
+static void BM_IntegerHistogramObserve(benchmark::State& state) {
+    static std::shared_ptr<IHistogram> histogram;
+
+    if (state.thread_index() == 0)
+        histogram = makeIntegerHistogram({ 1000, 2000, 5000, 10000, 20000, 50000, 100000 }, 1e-9);
+
+    std::vector<double> values;
+    for (int i = 0; i < 64; i++)
+        values.push_back((i * 37 + state.thread_index()) % 128 * 1000);
+
+    size_t i = 0;
+    for (auto _ : state)
+        histogram->observe(values[i++ & 63]);
+
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_IntegerHistogramObserve)->ThreadRange(1, maxThreads)->UseRealTime();
+
+static void BM_ExponentialHistogramObserve(benchmark::State& state) {
+    static std::shared_ptr<IExponentialHistogram> histogram;
+
+    if (state.thread_index() == 0)
+        histogram = makeExponentialHistogram();
+
+    std::vector<double> values;
+    for (int i = 0; i < 64; i++)
+        values.push_back((i * 37 + state.thread_index()) % 128 + 0.5);
+
+    size_t i = 0;
+    for (auto _ : state)
+        histogram->observe(values[i++ & 63]);
+
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ExponentialHistogramObserve)->ThreadRange(1, maxThreads)->UseRealTime();
+
+static void BM_HistogramObserveMany(benchmark::State& state) {
+    static std::shared_ptr<IHistogram> histogram;
+
+    if (state.thread_index() == 0)
+        histogram = makeHistogram({ 1., 2., 5., 10., 20., 50., 100. });
+
+    std::vector<double> values;
+    for (int64_t i = 0; i < state.range(0); i++)
+        values.push_back((i * 37 + state.thread_index()) % 128);
+
+    for (auto _ : state)
+        histogram->observeMany(values.data(), values.size());
+
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_HistogramObserveMany)->ArgName("batch")->RangeMultiplier(4)->Range(1, 1024)->ThreadRange(1, maxThreads)->UseRealTime();
 
 static void BM_SummaryObserve(benchmark::State& state) {
     static auto summary = makeSummary({ 0.9, 0.99, 0.999 }, 0.01);
@@ -68,20 +279,215 @@ static void BM_SummaryObserve(benchmark::State& state) {
 }
 BENCHMARK(BM_SummaryObserve)->ThreadRange(1, maxThreads)->UseRealTime();
 
+static void BM_HdrSummaryObserve(benchmark::State& state) {
+    static auto summary = makeHdrSummary({ 0.9, 0.99, 0.999 });
+    for (auto _ : state)
+        summary->observe(5);
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_HdrSummaryObserve)->ThreadRange(1, maxThreads)->UseRealTime();
+
 static void BM_RegistryGet(benchmark::State& state) {
     static auto registry = createRegistry();
     registry->getCounter("test");
+    const uint64_t start = s_allocations.load();
     for (auto _ : state)
         registry->getCounter("test");
+    reportAllocations(state, start);
 }
 BENCHMARK(BM_RegistryGet)->ThreadRange(1, maxThreads)->UseRealTime();
 
 static void BM_RegistryGetLabels(benchmark::State& state) {
     static auto registry = createRegistry();
     registry->getCounter("test", { {"a", "b"} });
+    const uint64_t start = s_allocations.load();
     for (auto _ : state)
         registry->getCounter("test", { {"a", "b"} });
+    reportAllocations(state, start);
 }
 BENCHMARK(BM_RegistryGetLabels)->ThreadRange(1, maxThreads)->UseRealTime();
 
+static void BM_RegistryGetLabelsMap(benchmark::State& state) {
+    static auto registry = createRegistry();
+    registry->getCounter("test", Labels{ {"a", "b"} });
+    const uint64_t start = s_allocations.load();
+    for (auto _ : state)
+        registry->getCounter("test", Labels{ {"a", "b"} });
+    reportAllocations(state, start);
+}
+BENCHMARK(BM_RegistryGetLabelsMap)->ThreadRange(1, maxThreads)->UseRealTime();
+
+static void BM_RegistryGetTwoLabels(benchmark::State& state) {
+    static auto registry = createRegistry();
+    registry->getCounter("test", { {"method", "GET"}, {"status", "200"} });
+    const uint64_t start = s_allocations.load();
+    for (auto _ : state)
+        registry->getCounter("test", { {"method", "GET"}, {"status", "200"} });
+    reportAllocations(state, start);
+}
+BENCHMARK(BM_RegistryGetTwoLabels)->ThreadRange(1, maxThreads)->UseRealTime();
+
+static void BM_FamilyWithLabelValues(benchmark::State& state) {
+    static auto registry = createRegistry();
+    static auto family = registry->getCounterFamily("test", { "method", "status" });
+    family.withLabelValues("GET", "200");
+    const uint64_t start = s_allocations.load();
+    for (auto _ : state)
+        family.withLabelValues("GET", "200");
+    reportAllocations(state, start);
+}
+BENCHMARK(BM_FamilyWithLabelValues)->ThreadRange(1, maxThreads)->UseRealTime();
+
+// Memory held by a registry per series, for series sharing a few dozen label names and values
+static void BM_RegistrySeriesMemory(benchmark::State& state) {
+    const char* methods[] = { "GET", "POST", "PUT", "DELETE" };
+    const char* statuses[] = { "200", "201", "204", "301", "400", "404", "500", "503" };
+    const int series = (int)state.range(0);
+    for (auto _ : state) {
+        state.PauseTiming();
+        std::vector<std::string> instances;
+        for (int i = 0; i < series / 32; i++)
+            instances.push_back("instance-" + std::to_string(i) + ".us-east-1.compute.internal");
+        const int64_t start = s_allocatedBytes.load();
+        state.ResumeTiming();
+
+        auto registry = createRegistry();
+        for (int i = 0; i < series; i++)
+            registry->getCounter("http_requests_total", { { "method", methods[i % 4] }, { "status", statuses[i / 4 % 8] }, { "instance", instances[i / 32] } });
+
+        state.PauseTiming();
+        state.counters["bytes_per_series"] = (double)(s_allocatedBytes.load() - start) / series;
+        registry.reset();
+        state.ResumeTiming();
+    }
+}
+BENCHMARK(BM_RegistrySeriesMemory)->Arg(100000)->Iterations(1)->Unit(benchmark::kMillisecond);
+
+// Memory retained by a registry after series with unique label values were created and removed
+static void BM_RegistryChurnMemory(benchmark::State& state) {
+    const int series = (int)state.range(0);
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto registry = createRegistry();
+        registry->getCounter("client_requests_total", { { "client", "initial" } });
+        const int64_t start = s_allocatedBytes.load();
+        state.ResumeTiming();
+
+        for (int i = 0; i < series; i++) {
+            const std::string client = "client-" + std::to_string(i) + ".example.com";
+            registry->getCounter("client_requests_total", { { "client", client } })++;
+            registry->remove("client_requests_total", { { "client", client } });
+        }
+
+        state.PauseTiming();
+        state.counters["retained_bytes"] = (double)(s_allocatedBytes.load() - start);
+        registry.reset();
+        state.ResumeTiming();
+    }
+}
+BENCHMARK(BM_RegistryChurnMemory)->Arg(100000)->Iterations(1)->Unit(benchmark::kMillisecond);
+
+// Creates 1M distinct series spread across 1000 names from all threads, with given number of registry shards
+static void BM_RegistryCreateSeries(benchmark::State& state) {
+    static std::shared_ptr<IRegistry> registry;
+    const int series = 1000000 / state.threads();
+    const std::string thread = std::to_string(state.thread_index());
+    if (state.thread_index() == 0) {
+        RegistryOptions options;
+        options.shards = (size_t)state.range(0);
+        registry = createRegistry(options);
+    }
+    for (auto _ : state) {
+        for (int i = 0; i < series; i++)
+            registry->getCounter("series_" + std::to_string(i % 1000), { { "thread", thread }, { "index", std::to_string(i / 1000) } });
+    }
+    state.SetItemsProcessed(series);
+    if (state.thread_index() == 0)
+        registry.reset();
+}
+BENCHMARK(BM_RegistryCreateSeries)->Arg(1)->Arg(16)->ThreadRange(1, maxThreads)->Iterations(1)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+static std::shared_ptr<IRegistry> collectedRegistry()
+{
+    static std::shared_ptr<IRegistry> registry;
+    if (!registry) {
+        registry = createRegistry();
+        for (int i = 0; i < 200000; i++)
+            registry->getCounter("series_" + std::to_string(i % 100), { { "method", "GET" }, { "index", std::to_string(i / 100) } })++;
+    }
+    return registry;
+}
+
+// Collection of 200k series through per-group copies of labels and metrics, as done by serializers before snapshots
+static void BM_RegistryCollectGroups(benchmark::State& state) {
+    auto registry = collectedRegistry();
+    const uint64_t start = s_allocations.load();
+    for (auto _ : state) {
+        uint64_t total = 0;
+        for (const auto& name : registry->metricNames())
+            for (const auto& metric : registry->getGroup(name).metrics())
+                total += std::static_pointer_cast<ICounterValue>(metric.second)->value();
+        benchmark::DoNotOptimize(total);
+    }
+    reportAllocations(state, start);
+}
+BENCHMARK(BM_RegistryCollectGroups)->Unit(benchmark::kMillisecond);
+
+static void BM_RegistrySnapshot(benchmark::State& state) {
+    auto registry = collectedRegistry();
+    RegistrySnapshot snapshot;
+    registry->snapshot(snapshot);
+    const uint64_t start = s_allocations.load();
+    for (auto _ : state) {
+        registry->snapshot(snapshot);
+        uint64_t total = 0;
+        for (size_t i = 0; i < snapshot.size(); i++)
+            total += snapshot.counter(i);
+        benchmark::DoNotOptimize(total);
+    }
+    reportAllocations(state, start);
+}
+BENCHMARK(BM_RegistrySnapshot)->Unit(benchmark::kMillisecond);
+
+// Collection of series changed since previous collection, with 1% of 200k series updated in between
+static void BM_RegistrySnapshotChanges(benchmark::State& state) {
+    auto registry = collectedRegistry();
+    std::vector<Counter> active;
+    for (int i = 0; i < 2000; i++)
+        active.push_back(registry->getCounter("series_" + std::to_string(i % 100), { { "method", "GET" }, { "index", std::to_string(i / 100) } }));
+    RegistrySnapshot snapshot;
+    registry->snapshot(snapshot);
+    for (auto _ : state) {
+        state.PauseTiming();
+        for (auto& counter : active)
+            counter++;
+        state.ResumeTiming();
+        registry->snapshot(snapshot, snapshot.generation());
+        benchmark::DoNotOptimize(snapshot.size());
+    }
+    state.counters["series"] = (double)snapshot.size();
+}
+BENCHMARK(BM_RegistrySnapshotChanges)->Unit(benchmark::kMillisecond);
+
+// Increments of series of one group from several threads while the first thread collects changes every
+// 1000 increments, so that updates keep crossing collection generations
+static void BM_CounterIncrementWhileCollecting(benchmark::State& state) {
+    static auto registry = createRegistry();
+    static std::vector<Counter> counters = []() {
+        std::vector<Counter> result;
+        for (int i = 0; i < 64; i++)
+            result.push_back(registry->getCounter("collected", { { "index", std::to_string(i) } }));
+        return result;
+    }();
+    RegistrySnapshot snapshot;
+    size_t i = state.thread_index();
+    for (auto _ : state) {
+        counters[i++ % counters.size()]++;
+        if (state.thread_index() == 0 && i % 1000 == 0)
+            registry->snapshot(snapshot, snapshot.generation());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CounterIncrementWhileCollecting)->ThreadRange(1, maxThreads)->UseRealTime();
+
 BENCHMARK_MAIN();
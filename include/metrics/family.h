@@ -0,0 +1,68 @@
+#pragma once
+
+#include <metrics_export.h>
+#include <metrics/metric.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Metrics
+{
+    /// <summary>
+    /// Index of series sharing a name and label names, keyed by label values in declaration order
+    /// </summary>
+    class IFamily
+    {
+    public:
+        virtual const std::vector<std::string>& labelNames() const = 0;
+
+        /// <summary>
+        /// Get or create series with given label values. Lookup of an existing series is lock-free and does not allocate memory
+        /// </summary>
+        /// <param name="values">one value per label name, in same order. Other counts throw logic_error</param>
+        virtual std::shared_ptr<IMetric> get(const StringView* values, size_t count) = 0;
+
+        /// <summary>
+        /// Remove series with given labels from the index, so that next get creates it again
+        /// </summary>
+        /// <returns>true if series was present</returns>
+        virtual bool remove(const Labels& labels) = 0;
+
+        METRICS_EXPORT virtual ~IFamily() = 0;
+    };
+
+    /// <summary>
+    /// Creates a family index. Series missing from the index are obtained from create, which is called with full labels
+    /// </summary>
+    /// <param name="labelNames">unique label names</param>
+    METRICS_EXPORT std::shared_ptr<IFamily> makeFamily(const std::vector<std::string>& labelNames, std::function<std::shared_ptr<IMetric>(const Labels&)> create);
+
+    /// <summary>
+    /// Metrics with same name and label names, e.g. {"method", "status"}, fetched by positional label values:
+    /// family.withLabelValues("GET", "200"). Declared once and reused, it avoids building and sorting labels per lookup
+    /// </summary>
+    template<typename TValueProxy> class Family
+    {
+    private:
+        std::shared_ptr<IFamily> m_family;
+
+    public:
+        Family(std::shared_ptr<IFamily> family) : m_family(family) {}
+        Family(const Family&) = default;
+        Family(Family&&) = default;
+
+        const std::vector<std::string>& labelNames() const { return m_family->labelNames(); }
+
+        /// <summary>
+        /// Get or create series with given label values, e.g. string literals or std::string
+        /// </summary>
+        template<typename... TValues> TValueProxy withLabelValues(const TValues&... values)
+        {
+            static_assert(sizeof...(values) > 0, "Family requires at least one label value");
+            const StringView views[] = { StringView(values)... };
+            return TValueProxy(std::static_pointer_cast<typename TValueProxy::value_type>(m_family->get(views, sizeof...(values))));
+        }
+    };
+}
@@ -1,10 +1,43 @@
 #pragma once
 
 #include <metrics/vecmap.h>
+#include <cstring>
 #include <string>
 
 namespace Metrics
 {
     typedef std::pair<std::string, std::string> Label;
     typedef vecmap<std::string, std::string> Labels;
+
+    /// <summary>
+    /// Non-owning reference to a character sequence, used to look up metrics without constructing strings.
+    /// Referenced characters must outlive the view
+    /// </summary>
+    class StringView
+    {
+    private:
+        const char* m_data;
+        size_t m_size;
+
+    public:
+        StringView() : m_data(""), m_size(0) {}
+        StringView(const char* data) : m_data(data), m_size(std::strlen(data)) {}
+        StringView(const char* data, size_t size) : m_data(data), m_size(size) {}
+        StringView(const std::string& value) : m_data(value.data()), m_size(value.size()) {}
+
+        const char* data() const { return m_data; }
+        size_t size() const { return m_size; }
+
+        std::string str() const { return std::string(m_data, m_size); }
+
+        bool operator==(const std::string& other) const { return m_size == other.size() && other.compare(0, m_size, m_data, m_size) == 0; }
+        bool operator!=(const std::string& other) const { return !(*this == other); }
+        bool operator==(StringView other) const { return m_size == other.m_size && std::memcmp(m_data, other.m_data, m_size) == 0; }
+        bool operator!=(StringView other) const { return !(*this == other); }
+    };
+
+    /// <summary>
+    /// Label referencing external name and value, e.g. string literals
+    /// </summary>
+    typedef std::pair<StringView, StringView> LabelView;
 }
@@ -0,0 +1,210 @@
+#pragma once
+
+#include <metrics/metric.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace Metrics
+{
+    /// <summary>
+    /// Flush all live local metrics into their shared targets. Called by serializers before
+    /// collecting a registry; should be called by custom collectors reading metric values directly
+    /// </summary>
+    METRICS_EXPORT void flushLocalMetrics();
+
+    /// <summary>
+    /// Base class for handles which buffer updates locally and publish them in batches.
+    /// Registers itself so that flushLocalMetrics() can reach it
+    /// </summary>
+    class LocalMetric
+    {
+    private:
+        bool m_registered;
+
+    protected:
+        std::mutex m_mutex;
+        const uint64_t m_countThreshold;
+        const uint64_t m_checkInterval;
+        const std::chrono::steady_clock::duration m_maxDelay;
+        std::chrono::steady_clock::time_point m_lastFlush;
+
+        METRICS_EXPORT LocalMetric(uint64_t countThreshold, std::chrono::steady_clock::duration maxDelay);
+        METRICS_EXPORT virtual ~LocalMetric();
+
+        // Must be called at the end of derived constructor and at the start of derived destructor,
+        // so that collectors never see a partially constructed or destroyed object
+        METRICS_EXPORT void enroll();
+        METRICS_EXPORT void unregister();
+
+        // Publishes buffered updates. Must be called under m_mutex
+        virtual void flushLocked() = 0;
+
+        bool due(uint64_t pending, std::chrono::steady_clock::time_point now) const
+        {
+            return pending >= m_countThreshold || now - m_lastFlush >= m_maxDelay;
+        }
+
+    public:
+        LocalMetric(const LocalMetric&) = delete;
+        LocalMetric& operator=(const LocalMetric&) = delete;
+
+        void flush()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            flushLocked();
+            m_lastFlush = std::chrono::steady_clock::now();
+        }
+    };
+
+    /// <summary>
+    /// Counter handle owned by a single thread, e.g. declared thread_local. Increments are plain
+    /// stores into the handle and are added to the shared counter when countThreshold increments
+    /// are pending, when an update finds maxDelay elapsed since last flush, on flushLocalMetrics()
+    /// (called by serializers) and on destruction (thread exit for thread_local handles).
+    /// Shared counter read through a serializer is exact; read directly, it may lag behind by
+    /// up to countThreshold increments per handle, or by updates made by a handle which became idle
+    /// </summary>
+    class LocalCounter final : public LocalMetric
+    {
+    private:
+        Counter m_target;
+        std::atomic<uint64_t> m_pending; // written by owner only; total since creation
+        uint64_t m_published;            // guarded by m_mutex
+        uint64_t m_nextCheck;            // owner only
+
+        void flushLocked() override
+        {
+            uint64_t delta = m_pending.load(std::memory_order_acquire) - m_published;
+            m_published += delta;
+            for (; delta > UINT32_MAX; delta -= UINT32_MAX)
+                m_target += UINT32_MAX;
+            if (delta != 0)
+                m_target += (uint32_t)delta;
+        }
+
+        void check(uint64_t pending)
+        {
+            m_nextCheck = pending + m_checkInterval;
+            std::unique_lock<std::mutex> lock(m_mutex);
+            const auto now = std::chrono::steady_clock::now();
+            if (due(pending - m_published, now)) {
+                flushLocked();
+                m_lastFlush = now;
+            }
+        }
+
+    public:
+        LocalCounter(Counter target, uint64_t countThreshold = 1024, std::chrono::steady_clock::duration maxDelay = std::chrono::seconds(1)) :
+            LocalMetric(countThreshold, maxDelay),
+            m_target(target),
+            m_pending(0),
+            m_published(0),
+            m_nextCheck(m_checkInterval)
+        {
+            enroll();
+        }
+
+        ~LocalCounter()
+        {
+            unregister();
+            flush();
+        }
+
+        LocalCounter& operator+=(uint64_t value)
+        {
+            // Only the owning thread writes, so load and store need no read-modify-write
+            const uint64_t pending = m_pending.load(std::memory_order_relaxed) + value;
+            m_pending.store(pending, std::memory_order_release);
+            if (pending >= m_nextCheck)
+                check(pending);
+            return *this;
+        }
+
+        LocalCounter& operator++(int) { return *this += 1; }
+
+        /// <summary>
+        /// Value of the shared counter including updates not yet flushed by this handle
+        /// </summary>
+        uint64_t value()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            return m_target.value() + (m_pending.load(std::memory_order_relaxed) - m_published);
+        }
+    };
+
+    /// <summary>
+    /// Histogram handle owned by a single thread. Observed values are buffered in the handle and
+    /// published with IHistogram::observeMany, with same flush triggers and staleness bound as
+    /// LocalCounter (countThreshold is also the buffer capacity)
+    /// </summary>
+    class LocalHistogram final : public LocalMetric
+    {
+    private:
+        Histogram m_target;
+        std::vector<double> m_buffer;
+        std::atomic<uint64_t> m_pending;   // written by owner only; total since creation
+        std::atomic<uint64_t> m_published; // written under m_mutex
+        uint64_t m_nextCheck;              // owner only
+
+        void flushLocked() override
+        {
+            const uint64_t pending = m_pending.load(std::memory_order_acquire);
+            uint64_t published = m_published.load(std::memory_order_relaxed);
+            while (published != pending) {
+                // Values form at most two contiguous ranges in the ring buffer
+                const size_t start = published % m_buffer.size();
+                const size_t count = (size_t)std::min<uint64_t>(pending - published, m_buffer.size() - start);
+                m_target.observeMany(m_buffer.data() + start, count);
+                published += count;
+            }
+            m_published.store(published, std::memory_order_release);
+        }
+
+        void check(uint64_t pending)
+        {
+            m_nextCheck = pending + m_checkInterval;
+            std::unique_lock<std::mutex> lock(m_mutex);
+            const auto now = std::chrono::steady_clock::now();
+            if (due(pending - m_published.load(std::memory_order_relaxed), now)) {
+                flushLocked();
+                m_lastFlush = now;
+            }
+        }
+
+    public:
+        LocalHistogram(Histogram target, uint64_t countThreshold = 256, std::chrono::steady_clock::duration maxDelay = std::chrono::seconds(1)) :
+            LocalMetric(countThreshold, maxDelay),
+            m_target(target),
+            m_buffer((size_t)countThreshold),
+            m_pending(0),
+            m_published(0),
+            m_nextCheck(m_checkInterval)
+        {
+            enroll();
+        }
+
+        ~LocalHistogram()
+        {
+            unregister();
+            flush();
+        }
+
+        LocalHistogram& observe(double value)
+        {
+            uint64_t pending = m_pending.load(std::memory_order_relaxed);
+            // Slot is free once the value previously stored there has been published
+            if (pending - m_published.load(std::memory_order_acquire) >= m_buffer.size())
+                flush();
+            m_buffer[pending % m_buffer.size()] = value;
+            m_pending.store(++pending, std::memory_order_release);
+            if (pending >= m_nextCheck)
+                check(pending);
+            return *this;
+        }
+    };
+}
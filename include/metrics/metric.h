@@ -3,8 +3,12 @@
 #include <metrics/labels.h>
 #include <metrics_export.h>
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <string>
 #include <memory>
+#include <vector>
 
 namespace Metrics
 {
@@ -12,7 +16,10 @@ namespace Metrics
     class ICounterValue;
     class IGaugeValue;
     class IHistogram;
+    class IHistogramBuckets;
+    class IExponentialHistogram;
     class ISummary;
+    class ModificationStamp;
 
     class IMetricVisitor
     {
@@ -20,14 +27,50 @@ namespace Metrics
         virtual void visit(ICounterValue&) = 0;
         virtual void visit(IGaugeValue&) = 0;
         virtual void visit(IHistogram&) = 0;
+        virtual void visit(IExponentialHistogram&) = 0;
         virtual void visit(ISummary&) = 0;
         METRICS_EXPORT virtual ~IMetricVisitor() = default;
     };
 
-    METRICS_EXPORT std::shared_ptr<ICounterValue> makeCounter();
-    METRICS_EXPORT std::shared_ptr<IGaugeValue> makeGauge();
-    METRICS_EXPORT std::shared_ptr<IHistogram> makeHistogram(const std::vector<double>& bounds);
+    /// <summary>
+    /// Storage layout of a metric value which is updated concurrently
+    /// </summary>
+    enum class Sharding {
+        /// All threads update one atomic value. Smallest footprint, best for metrics updated from few threads
+        None,
+        /// Updates go to cache-line-padded per-thread slots which are summed on read. Scales with thread count at the cost of memory
+        PerThread
+    };
+
+    /// <summary>
+    /// Representation of a gauge value
+    /// </summary>
+    enum class GaugeKind {
+        /// Double precision value. Increments and decrements use a compare-exchange loop
+        Floating,
+        /// Fixed-point value with 1e-6 resolution in range of about +/-9.2e12. Increments and
+        /// decrements are a single atomic add, suited for gauges used as up/down counters.
+        /// Values outside the range saturate, NaN is stored as zero
+        UpDown
+    };
+
+    METRICS_EXPORT std::shared_ptr<ICounterValue> makeCounter(Sharding sharding = Sharding::None);
+    METRICS_EXPORT std::shared_ptr<IGaugeValue> makeGauge(GaugeKind kind = GaugeKind::Floating, Sharding sharding = Sharding::None);
+    METRICS_EXPORT std::shared_ptr<IHistogram> makeHistogram(const std::vector<double>& bounds, Sharding sharding = Sharding::None);
+    METRICS_EXPORT std::shared_ptr<IHistogram> makeHistogram(std::shared_ptr<const IHistogramBuckets> buckets, Sharding sharding = Sharding::None);
+    METRICS_EXPORT std::shared_ptr<IHistogram> makeIntegerHistogram(const std::vector<uint64_t>& bounds, double unit = 1.);
+    METRICS_EXPORT std::shared_ptr<const IHistogramBuckets> makeBuckets(const std::vector<double>& bounds);
+    METRICS_EXPORT std::shared_ptr<const IHistogramBuckets> makeLinearBuckets(double start, double width, size_t count);
+    METRICS_EXPORT std::shared_ptr<const IHistogramBuckets> makeExponentialBuckets(double start, double factor, size_t count);
+    METRICS_EXPORT std::shared_ptr<IExponentialHistogram> makeExponentialHistogram(int32_t scale = 8, size_t maxBuckets = 160, double zeroThreshold = 0.);
     METRICS_EXPORT std::shared_ptr<ISummary> makeSummary(const std::vector<double>& quantiles, double error);
+    METRICS_EXPORT std::shared_ptr<ISummary> makeSummary(const std::vector<double>& quantiles, double error, std::chrono::steady_clock::duration maxAge, size_t ageBuckets = 5);
+    METRICS_EXPORT std::shared_ptr<ISummary> makeHdrSummary(const std::vector<double>& quantiles, uint64_t highest = 3600000000000ull, int significantDigits = 2);
+
+    /// <summary>
+    /// Allocates a collection generation. Generations increase across all registries of the process
+    /// </summary>
+    METRICS_EXPORT uint64_t nextCollectionGeneration();
 #pragma endregion
 
 #pragma region Common definitions
@@ -35,7 +78,8 @@ namespace Metrics
         Gauge,
         Counter,
         Summary,
-        Histogram
+        Histogram,
+        ExponentialHistogram
     };
 
     class IMetric
@@ -48,6 +92,42 @@ namespace Metrics
         METRICS_EXPORT virtual ~IMetric() = default;
         virtual TypeCode type() = 0;
         virtual void accept(IMetricVisitor&) = 0;
+
+        /// <summary>
+        /// Modification stamp of the metric, which lets registries find changed series without reading
+        /// values of all series. nullptr if the metric does not track modifications
+        /// </summary>
+        virtual ModificationStamp* modificationStamp() { return nullptr; }
+    };
+
+    /// <summary>
+    /// Collection generation in which a metric was last modified, touched after each update. Registries compare
+    /// stamps with the generation of their previous collection to find changed series. The stamp is written at
+    /// most once per collection generation, so that other updates only read it
+    /// </summary>
+    class ModificationStamp
+    {
+    private:
+        std::atomic<uint64_t> m_generation;
+
+        // Last generation allocated by nextCollectionGeneration
+        METRICS_EXPORT static std::atomic<uint64_t> s_current;
+        friend uint64_t nextCollectionGeneration();
+
+    public:
+        ModificationStamp() noexcept : m_generation(0) {};
+        ModificationStamp(const ModificationStamp&) = delete;
+
+        void touch() noexcept
+        {
+            // Sequentially consistent, so that an update missed by a collection reads a generation not older than the collection's.
+            // Stamp only grows, so that an update which read an older generation does not hide a later one
+            const uint64_t current = s_current.load();
+            uint64_t stamp = m_generation.load(std::memory_order_relaxed);
+            while (stamp < current && !m_generation.compare_exchange_weak(stamp, current, std::memory_order_relaxed)) {}
+        }
+
+        uint64_t value() const noexcept { return m_generation.load(std::memory_order_relaxed); }
     };
 
     template<TypeCode T> class ITypedMetric : public IMetric
@@ -72,6 +152,7 @@ namespace Metrics
     public:
         typedef Value value_type;
         std::shared_ptr<IMetric> raw() { return m_value; }
+        ModificationStamp* modificationStamp() override { return m_value->modificationStamp(); }
     };
 #pragma endregion
 
@@ -108,6 +189,16 @@ namespace Metrics
     {
     public:
         virtual IHistogram& observe(double value) = 0;
+        /// <summary>
+        /// Observe a contiguous range of values. Equivalent to calling observe for each value,
+        /// but implementations publish the whole batch with one update per touched bucket
+        /// </summary>
+        METRICS_EXPORT virtual IHistogram& observeMany(const double* values, size_t count);
+        /// <summary>
+        /// Observe an integer value, e.g. a duration count. Integer histograms record it exactly in their integer
+        /// units, other histograms observe it converted to double
+        /// </summary>
+        METRICS_EXPORT virtual IHistogram& observeInteger(uint64_t value);
         virtual uint64_t count() const = 0;
         virtual double sum() const = 0;
         virtual std::vector<std::pair<double, uint64_t>> values() const = 0;
@@ -117,10 +208,71 @@ namespace Metrics
         METRICS_EXPORT virtual ~IHistogram() = 0;
     };
 
+    /// <summary>
+    /// Immutable set of histogram buckets. A single instance can be shared by any number of histograms.
+    /// Linear and exponential buckets find the bucket for a value in constant time
+    /// </summary>
+    class IHistogramBuckets
+    {
+    public:
+        /// <summary>
+        /// Sorted upper bounds of buckets, ending with +Inf
+        /// </summary>
+        virtual const std::vector<double>& bounds() const = 0;
+
+        /// <summary>
+        /// Index of the bucket which value falls into, i.e. of the first bound not less than value
+        /// </summary>
+        virtual size_t bucket(double value) const = 0;
+
+        METRICS_EXPORT virtual ~IHistogramBuckets() = default;
+    };
+
+    /// <summary>
+    /// Populated buckets of an exponential histogram. At scale s, bucket with index i holds
+    /// values with absolute value in (base^i, base^(i+1)], where base = 2^(2^-s)
+    /// </summary>
+    struct ExponentialBuckets
+    {
+        int32_t scale;
+        double zeroThreshold;
+        /// Number of values with absolute value not above zeroThreshold
+        uint64_t zeroCount;
+        /// (index, count) pairs for positive values, sorted by index. Empty buckets are omitted
+        std::vector<std::pair<int32_t, uint64_t>> positive;
+        /// (index, count) pairs for negative values by absolute value, sorted by index. Empty buckets are omitted
+        std::vector<std::pair<int32_t, uint64_t>> negative;
+
+        /// Lower bound of absolute values in bucket at given scale and index
+        METRICS_EXPORT static double lowerBound(int32_t scale, int32_t index);
+    };
+
+    /// <summary>
+    /// Histogram with exponentially growing buckets, compatible with Prometheus native histograms
+    /// and OpenTelemetry exponential histograms. Only a bounded window of buckets is stored; when
+    /// a value does not fit, the scale is reduced so that neighboring buckets merge.
+    /// </summary>
+    class IExponentialHistogram : public ITypedMetric<TypeCode::ExponentialHistogram>
+    {
+    public:
+        virtual IExponentialHistogram& observe(double value) = 0;
+        virtual uint64_t count() const = 0;
+        virtual double sum() const = 0;
+        virtual ExponentialBuckets values() const = 0;
+        METRICS_EXPORT virtual void accept(IMetricVisitor&) override;
+
+    protected:
+        METRICS_EXPORT virtual ~IExponentialHistogram() = 0;
+    };
+
     class ISummary : public ITypedMetric<TypeCode::Summary>
     {
     public:
         virtual ISummary& observe(double value) = 0;
+        /// <summary>
+        /// Observe a contiguous range of values. Equivalent to calling observe for each value
+        /// </summary>
+        METRICS_EXPORT virtual ISummary& observeMany(const double* values, size_t count);
         virtual uint64_t count() const = 0;
         virtual double sum() const = 0;
         virtual std::vector<std::pair<double, uint64_t>> values() const = 0;
@@ -131,17 +283,115 @@ namespace Metrics
     };
 #pragma endregion
 
+#pragma region Implementations
+    /// <summary>
+    /// Default counter implementation. Defined in header and final, so that Counter
+    /// can update it with an inlined atomic instruction instead of a call into the library
+    /// </summary>
+    class CounterValue final : public ICounterValue
+    {
+    private:
+        std::atomic<uint64_t> m_value;
+        ModificationStamp m_modified;
+
+    public:
+        CounterValue() noexcept : m_value(0) {};
+        CounterValue(uint64_t value) noexcept : m_value(value) {};
+        CounterValue(CounterValue&& other) = delete;
+        CounterValue(const CounterValue&) = delete;
+        METRICS_EXPORT ~CounterValue();
+
+        ICounterValue& operator++(int) override
+        {
+            m_value.fetch_add(1, std::memory_order_acq_rel);
+            m_modified.touch();
+            return *this;
+        };
+        ICounterValue& operator+=(uint32_t value) override
+        {
+            m_value.fetch_add(value, std::memory_order_acq_rel);
+            m_modified.touch();
+            return *this;
+        };
+        void add(uint64_t value)
+        {
+            m_value.fetch_add(value, std::memory_order_acq_rel);
+            m_modified.touch();
+        };
+        uint64_t value() const override
+        {
+            return m_value.load(std::memory_order_acquire);
+        };
+        void reset() override
+        {
+            m_value.store(0, std::memory_order_release);
+            m_modified.touch();
+        };
+        ModificationStamp* modificationStamp() override { return &m_modified; }
+    };
+
+    /// <summary>
+    /// Default gauge implementation. Defined in header and final, so that Gauge
+    /// can update it without a call into the library
+    /// </summary>
+    class GaugeValue final : public IGaugeValue
+    {
+    private:
+        std::atomic<double> m_value;
+        ModificationStamp m_modified;
+
+    public:
+        GaugeValue() noexcept : m_value(0.) {};
+        GaugeValue(GaugeValue&&) = delete;
+        GaugeValue(const GaugeValue&) = delete;
+        METRICS_EXPORT ~GaugeValue();
+
+        IGaugeValue& operator=(double value) override
+        {
+            m_value.store(value);
+            m_modified.touch();
+            return *this;
+        };
+        IGaugeValue& operator+=(double value) override
+        {
+            double oldv = m_value.load(std::memory_order_relaxed);
+            while (!m_value.compare_exchange_weak(oldv, oldv + value))
+                ;
+            m_modified.touch();
+            return *this;
+        };
+        IGaugeValue& operator-=(double value) override
+        {
+            double oldv = m_value.load(std::memory_order_relaxed);
+            while (!m_value.compare_exchange_weak(oldv, oldv - value))
+                ;
+            m_modified.touch();
+            return *this;
+        };
+        double value() const override
+        {
+            return m_value.load();
+        };
+        ModificationStamp* modificationStamp() override { return &m_modified; }
+    };
+#pragma endregion
+
 #pragma region Stack containers
     class Counter : public ValueProxy<ICounterValue>
     {
+    private:
+        // Set when the value is a CounterValue - updates are then inlined
+        CounterValue* const m_fast;
+
     public:
-        ICounterValue& operator++(int) override { return (*m_value)++; };
-        ICounterValue& operator+=(uint32_t value) override { return (*m_value += value); };
+        ICounterValue& operator++(int) override { return m_fast ? (*m_fast)++ : (*m_value)++; };
+        ICounterValue& operator+=(uint32_t value) override { return m_fast ? (*m_fast += value) : (*m_value += value); };
         void reset() override { m_value->reset(); };
-        uint64_t value() const override { return m_value->value(); };
+        uint64_t value() const override { return m_fast ? m_fast->value() : m_value->value(); };
 
-        Counter() : ValueProxy(makeCounter()) {};
-        Counter(std::shared_ptr<ICounterValue> value) : ValueProxy(value) {};
+        Counter() : Counter(makeCounter()) {};
+        explicit Counter(Sharding sharding) : Counter(makeCounter(sharding)) {};
+        Counter(std::shared_ptr<ICounterValue> value) : ValueProxy(value), m_fast(dynamic_cast<CounterValue*>(value.get())) {};
         Counter(const Counter&) = default;
         Counter(Counter&&) = default;
         ~Counter() = default;
@@ -149,34 +399,101 @@ namespace Metrics
 
     class Gauge : public ValueProxy<IGaugeValue>
     {
+    private:
+        // Set when the value is a GaugeValue - updates are then inlined
+        GaugeValue* const m_fast;
+
     public:
-        IGaugeValue& operator=(double value) override { return (*m_value = value); };
-        IGaugeValue& operator+=(double value) override { return (*m_value += value); };
-        IGaugeValue& operator-=(double value) override { return (*m_value -= value); };
-        double value() const override { return m_value->value(); };
+        IGaugeValue& operator=(double value) override { return m_fast ? (*m_fast = value) : (*m_value = value); };
+        IGaugeValue& operator+=(double value) override { return m_fast ? (*m_fast += value) : (*m_value += value); };
+        IGaugeValue& operator-=(double value) override { return m_fast ? (*m_fast -= value) : (*m_value -= value); };
+        double value() const override { return m_fast ? m_fast->value() : m_value->value(); };
 
-        Gauge() : ValueProxy(makeGauge()) {};
-        Gauge(std::shared_ptr<IGaugeValue> value) : ValueProxy(value) {};
+        Gauge() : Gauge(makeGauge()) {};
+        explicit Gauge(GaugeKind kind, Sharding sharding = Sharding::None) : Gauge(makeGauge(kind, sharding)) {};
+        Gauge(std::shared_ptr<IGaugeValue> value) : ValueProxy(value), m_fast(dynamic_cast<GaugeValue*>(value.get())) {};
         Gauge(const Gauge&) = default;
         Gauge(Gauge&&) = default;
         ~Gauge() = default;
     };
 
+    /// <summary>
+    /// Non-owning counter handle. Copying does not touch a reference count, which makes it cheap
+    /// to pass by value across threads. Referenced counter must outlive the handle - handles
+    /// returned by IRegistry::getCounterRef are valid for the lifetime of the registry
+    /// </summary>
+    class CounterRef
+    {
+    private:
+        ICounterValue* m_value;
+        CounterValue* m_fast;
+
+    public:
+        explicit CounterRef(ICounterValue& value) : m_value(&value), m_fast(dynamic_cast<CounterValue*>(&value)) {};
+        CounterRef(const CounterRef&) = default;
+        CounterRef& operator=(const CounterRef&) = default;
+
+        CounterRef& operator++(int) { m_fast ? (*m_fast)++ : (*m_value)++; return *this; };
+        CounterRef& operator+=(uint32_t value) { m_fast ? (*m_fast += value) : (*m_value += value); return *this; };
+        void reset() { m_value->reset(); };
+        uint64_t value() const { return m_fast ? m_fast->value() : m_value->value(); };
+    };
+
+    /// <summary>
+    /// Non-owning gauge handle. Copying does not touch a reference count, which makes it cheap
+    /// to pass by value across threads. Referenced gauge must outlive the handle - handles
+    /// returned by IRegistry::getGaugeRef are valid for the lifetime of the registry
+    /// </summary>
+    class GaugeRef
+    {
+    private:
+        IGaugeValue* m_value;
+        GaugeValue* m_fast;
+
+    public:
+        explicit GaugeRef(IGaugeValue& value) : m_value(&value), m_fast(dynamic_cast<GaugeValue*>(&value)) {};
+        GaugeRef(const GaugeRef&) = default;
+        GaugeRef& operator=(const GaugeRef&) = default;
+
+        GaugeRef& operator=(double value) { m_fast ? (*m_fast = value) : (*m_value = value); return *this; };
+        GaugeRef& operator+=(double value) { m_fast ? (*m_fast += value) : (*m_value += value); return *this; };
+        GaugeRef& operator-=(double value) { m_fast ? (*m_fast -= value) : (*m_value -= value); return *this; };
+        double value() const { return m_fast ? m_fast->value() : m_value->value(); };
+    };
+
     class Histogram : public ValueProxy<IHistogram>
     {
     public:
         IHistogram& observe(double value) override { return m_value->observe(value); };
+        IHistogram& observeMany(const double* values, size_t count) override { return m_value->observeMany(values, count); };
+        IHistogram& observeInteger(uint64_t value) override { return m_value->observeInteger(value); };
         uint64_t count() const override { return m_value->count(); };
         double sum() const override { return m_value->sum(); };
         std::vector<std::pair<double, uint64_t>> values() const override { return m_value->values(); };
 
-        Histogram(const std::vector<double>& bounds) : ValueProxy(makeHistogram(bounds)) {};
+        Histogram(const std::vector<double>& bounds, Sharding sharding = Sharding::None) : ValueProxy(makeHistogram(bounds, sharding)) {};
+        Histogram(std::shared_ptr<const IHistogramBuckets> buckets, Sharding sharding = Sharding::None) : ValueProxy(makeHistogram(buckets, sharding)) {};
         Histogram(std::shared_ptr<IHistogram> value) : ValueProxy(value) {};
         Histogram(const Histogram&) = default;
         Histogram(Histogram&&) = default;
         ~Histogram() = default;
     };
 
+    class ExponentialHistogram : public ValueProxy<IExponentialHistogram>
+    {
+    public:
+        IExponentialHistogram& observe(double value) override { return m_value->observe(value); };
+        uint64_t count() const override { return m_value->count(); };
+        double sum() const override { return m_value->sum(); };
+        ExponentialBuckets values() const override { return m_value->values(); };
+
+        ExponentialHistogram(int32_t scale = 8, size_t maxBuckets = 160, double zeroThreshold = 0.) : ValueProxy(makeExponentialHistogram(scale, maxBuckets, zeroThreshold)) {};
+        ExponentialHistogram(std::shared_ptr<IExponentialHistogram> value) : ValueProxy(value) {};
+        ExponentialHistogram(const ExponentialHistogram&) = default;
+        ExponentialHistogram(ExponentialHistogram&&) = default;
+        ~ExponentialHistogram() = default;
+    };
+
     /// <summary>
     /// Class calculating approximate quantiles for incoming data
     /// https://prometheus.io/docs/practices/histograms/#:~:text=Two%20rules%20of%20thumb%3A,distribution%20of%20the%20values%20is.
@@ -185,11 +502,17 @@ namespace Metrics
     {
     public:
         ISummary& observe(double value) override { return m_value->observe(value); };
+        ISummary& observeMany(const double* values, size_t count) override { return m_value->observeMany(values, count); };
         uint64_t count() const override { return m_value->count(); };
         double sum() const override { return m_value->sum(); };
         std::vector<std::pair<double, uint64_t>> values() const override { return m_value->values(); };
 
         Summary(const std::vector<double>& quantiles, double error = 0.01) : ValueProxy(makeSummary(quantiles, error)) {};
+        /// <summary>
+        /// Summary reporting quantiles over values observed during last maxAge only.
+        /// Window slides in steps of maxAge / ageBuckets; count and sum are cumulative
+        /// </summary>
+        Summary(const std::vector<double>& quantiles, double error, std::chrono::steady_clock::duration maxAge, size_t ageBuckets = 5) : ValueProxy(makeSummary(quantiles, error, maxAge, ageBuckets)) {};
         Summary(std::shared_ptr<ISummary> value) : ValueProxy(value) {};
         Summary(const Summary&) = default;
         Summary(Summary&&) = default;
@@ -8,6 +8,7 @@
 namespace Metrics {
     namespace Prometheus {
         METRICS_EXPORT std::string serialize(std::shared_ptr<IRegistry> registry);
+        METRICS_EXPORT std::string serialize(const RegistrySnapshot& snapshot);
         METRICS_EXPORT std::shared_ptr<IOnDemandSink> createPushGatewaySink(const std::string& url);
         METRICS_EXPORT std::shared_ptr<IRegistrySink> createPrometheusHttpServerSink(std::shared_ptr<IRegistry> registry, const std::string& address, const std::string& port);
     }
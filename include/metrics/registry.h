@@ -2,7 +2,14 @@
 
 #include <metrics_export.h>
 #include <metrics/metric.h>
+#include <metrics/family.h>
+#include <metrics/snapshot.h>
 
+#include <chrono>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <stdexcept>
 #include <vector>
 #include <tuple>
 
@@ -16,8 +23,21 @@ namespace Metrics
         virtual ~IMetricGroup() = 0;
     };
 
-    class IRegistry
+    /// <summary>
+    /// Registry of metrics. Registries must be owned by std::shared_ptr, which families refer to
+    /// </summary>
+    class IRegistry : public std::enable_shared_from_this<IRegistry>
     {
+    private:
+        // Families hold their registry weakly, so that they do not keep it alive nor outlive it unnoticed
+        static std::shared_ptr<IRegistry> lock(const std::weak_ptr<IRegistry>& registry)
+        {
+            auto result = registry.lock();
+            if (!result)
+                throw std::logic_error("Registry of family was destroyed");
+            return result;
+        }
+
     public:
         virtual std::vector<std::string> metricNames() const = 0;
 
@@ -25,19 +45,77 @@ namespace Metrics
 
         virtual size_t size() const = 0;
 
+        /// <summary>
+        /// Collect series in one pass, ordered by name. Previous content of snapshot is replaced
+        /// </summary>
+        /// <param name="since">generation of an earlier snapshot to collect only series changed or created after it, or 0 to collect all series</param>
+        void snapshot(RegistrySnapshot& snapshot, uint64_t since = 0)
+        {
+            snapshot.reset();
+            collect(snapshot, since);
+        }
+
+        /// <summary>
+        /// Append series to snapshot, attributing observed changes to a newly allocated generation which is recorded
+        /// in the snapshot. Used by composite registries
+        /// </summary>
+        virtual void collect(RegistrySnapshot& snapshot, uint64_t since) = 0;
+
         /// <summary>
         /// Get or create a gauge with provided key
         /// </summary>
         /// <param name="key">metric key</param>
+        /// <param name="kind">value representation used if the gauge is created by this call</param>
+        /// <param name="sharding">storage layout used if the gauge is created by this call. Only applies to GaugeKind::UpDown</param>
         /// <returns>new or existing metric object</returns>
-        virtual Gauge getGauge(const std::string& name, const Labels& labels = {}) = 0;
+        virtual Gauge getGauge(const std::string& name, const Labels& labels = {}, GaugeKind kind = GaugeKind::Floating, Sharding sharding = Sharding::None) = 0;
+
+        /// <summary>
+        /// Get or create a gauge with key given as views. Lookup of an existing gauge does not allocate memory
+        /// </summary>
+        /// <param name="labels">labels in any order, e.g. {{"kind", "pigeon"}}</param>
+        template<typename TName> Gauge getGauge(const TName& name, std::initializer_list<LabelView> labels, GaugeKind kind = GaugeKind::Floating, Sharding sharding = Sharding::None)
+        {
+            return getGauge(StringView(name), labels.begin(), labels.size(), kind, sharding);
+        }
+
+        virtual Gauge getGauge(StringView name, const LabelView* labels, size_t count, GaugeKind kind, Sharding sharding) = 0;
 
         /// <summary>
         /// Get or create a counter with provided key
         /// </summary>
         /// <param name="key">metric key</param>
+        /// <param name="sharding">storage layout used if the counter is created by this call</param>
         /// <returns>new or existing metric object</returns>
-        virtual Counter getCounter(const std::string& name, const Labels& labels = {}) = 0;
+        virtual Counter getCounter(const std::string& name, const Labels& labels = {}, Sharding sharding = Sharding::None) = 0;
+
+        /// <summary>
+        /// Get or create a counter with key given as views. Lookup of an existing counter does not allocate memory
+        /// </summary>
+        /// <param name="labels">labels in any order, e.g. {{"kind", "pigeon"}}</param>
+        template<typename TName> Counter getCounter(const TName& name, std::initializer_list<LabelView> labels, Sharding sharding = Sharding::None)
+        {
+            return getCounter(StringView(name), labels.begin(), labels.size(), sharding);
+        }
+
+        virtual Counter getCounter(StringView name, const LabelView* labels, size_t count, Sharding sharding) = 0;
+
+        /// <summary>
+        /// Get or create a counter with provided key, returning a non-owning handle
+        /// </summary>
+        /// <param name="key">metric key</param>
+        /// <param name="sharding">storage layout used if the counter is created by this call</param>
+        /// <returns>handle valid for the lifetime of the registry</returns>
+        virtual CounterRef getCounterRef(const std::string& name, const Labels& labels = {}, Sharding sharding = Sharding::None) = 0;
+
+        /// <summary>
+        /// Get or create a gauge with provided key, returning a non-owning handle
+        /// </summary>
+        /// <param name="key">metric key</param>
+        /// <param name="kind">value representation used if the gauge is created by this call</param>
+        /// <param name="sharding">storage layout used if the gauge is created by this call. Only applies to GaugeKind::UpDown</param>
+        /// <returns>handle valid for the lifetime of the registry</returns>
+        virtual GaugeRef getGaugeRef(const std::string& name, const Labels& labels = {}, GaugeKind kind = GaugeKind::Floating, Sharding sharding = Sharding::None) = 0;
 
         /// <summary>
         /// Get or create a summary with provided key
@@ -46,12 +124,114 @@ namespace Metrics
         /// <returns>new or existing metric object</returns>
         virtual Summary getSummary(const std::string& name, const Labels& labels = {}, const std::vector<double>& quantiles = { 0.50, 0.90, 0.99, 0.999 }, double error = 0.01) = 0;
 
+        /// <summary>
+        /// Get or create a summary with provided key, reporting quantiles over a sliding time window
+        /// </summary>
+        /// <param name="key">metric key</param>
+        /// <param name="maxAge">values older than maxAge are not included in quantiles</param>
+        /// <param name="ageBuckets">number of steps the window slides in</param>
+        /// <returns>new or existing metric object</returns>
+        virtual Summary getSummary(const std::string& name, const Labels& labels, const std::vector<double>& quantiles, double error, std::chrono::steady_clock::duration maxAge, size_t ageBuckets = 5) = 0;
+
+        /// <summary>
+        /// Get or create a lock-free summary backed by a high dynamic range histogram.
+        /// Values are recorded as integers (e.g. nanoseconds) with fixed relative precision
+        /// </summary>
+        /// <param name="key">metric key</param>
+        /// <param name="highest">highest trackable value; larger values are recorded as highest</param>
+        /// <param name="significantDigits">number of significant decimal digits preserved for each value</param>
+        /// <returns>new or existing metric object</returns>
+        virtual Summary getHdrSummary(const std::string& name, const Labels& labels = {}, const std::vector<double>& quantiles = { 0.50, 0.90, 0.99, 0.999 }, uint64_t highest = 3600000000000ull, int significantDigits = 2) = 0;
+
         /// <summary>
         /// Get or create a histogram with provided key
         /// </summary>
         /// <param name="key">metric key</param>
+        /// <param name="sharding">storage layout used if the histogram is created by this call</param>
         /// <returns>new or existing metric object</returns>
-        virtual Histogram getHistogram(const std::string& name, const Labels& labels = {}, const std::vector<double>& bounds = { 100., 200., 300., 400., 500. }) = 0;
+        virtual Histogram getHistogram(const std::string& name, const Labels& labels = {}, const std::vector<double>& bounds = { 100., 200., 300., 400., 500. }, Sharding sharding = Sharding::None) = 0;
+
+        /// <summary>
+        /// Get or create a histogram with key given as views. Lookup of an existing histogram does not allocate memory
+        /// </summary>
+        /// <param name="labels">labels in any order, e.g. {{"kind", "pigeon"}}</param>
+        /// <param name="bounds">bounds used if the histogram is created by this call</param>
+        template<typename TName> Histogram getHistogram(const TName& name, std::initializer_list<LabelView> labels, const std::vector<double>& bounds = { 100., 200., 300., 400., 500. }, Sharding sharding = Sharding::None)
+        {
+            return getHistogram(StringView(name), labels.begin(), labels.size(), bounds, sharding);
+        }
+
+        virtual Histogram getHistogram(StringView name, const LabelView* labels, size_t count, const std::vector<double>& bounds, Sharding sharding) = 0;
+
+        /// <summary>
+        /// Get or create a histogram with provided key, sharing an existing buckets instance
+        /// </summary>
+        /// <param name="key">metric key</param>
+        /// <param name="buckets">buckets created by makeBuckets, makeLinearBuckets or makeExponentialBuckets</param>
+        /// <param name="sharding">storage layout used if the histogram is created by this call</param>
+        /// <returns>new or existing metric object</returns>
+        virtual Histogram getHistogram(const std::string& name, const Labels& labels, std::shared_ptr<const IHistogramBuckets> buckets, Sharding sharding = Sharding::None) = 0;
+
+        /// <summary>
+        /// Get or create a histogram over integer values (e.g. nanoseconds) with provided key.
+        /// Observations are rounded to integers; bucket bounds and sum are reported multiplied by unit.
+        /// Timers must measure in the integer unit, e.g. Timer&lt;std::chrono::nanoseconds&gt; for unit 1e-9
+        /// </summary>
+        /// <param name="key">metric key</param>
+        /// <param name="bounds">bucket bounds in integer units</param>
+        /// <param name="unit">scale applied when reading, e.g. 1e-9 to report nanoseconds as seconds</param>
+        /// <returns>new or existing metric object</returns>
+        virtual Histogram getIntegerHistogram(const std::string& name, const Labels& labels, const std::vector<uint64_t>& bounds, double unit = 1.) = 0;
+
+        /// <summary>
+        /// Get or create an exponential histogram with provided key
+        /// </summary>
+        /// <param name="key">metric key</param>
+        /// <param name="scale">initial resolution, reduced automatically when maxBuckets is exceeded</param>
+        /// <param name="maxBuckets">maximum number of populated buckets per sign</param>
+        /// <param name="zeroThreshold">values with absolute value not above threshold are counted in zero bucket</param>
+        /// <returns>new or existing metric object</returns>
+        virtual ExponentialHistogram getExponentialHistogram(const std::string& name, const Labels& labels = {}, int32_t scale = 8, size_t maxBuckets = 160, double zeroThreshold = 0.) = 0;
+
+        /// <summary>
+        /// Declare a family of counters with given label names. Series are created in this registry on first use
+        /// </summary>
+        /// <param name="labelNames">label names, values for which are given to Family::withLabelValues in same order</param>
+        /// <param name="sharding">storage layout of counters created by the family</param>
+        /// <returns>family which creates series while the registry is alive, and throws std::logic_error afterwards</returns>
+        Family<Counter> getCounterFamily(const std::string& name, const std::vector<std::string>& labelNames, Sharding sharding = Sharding::None)
+        {
+            std::weak_ptr<IRegistry> registry = shared_from_this();
+            return getFamily(name, labelNames, [registry, name, sharding](const Labels& labels) { return lock(registry)->getCounter(name, labels, sharding).raw(); });
+        }
+
+        /// <summary>
+        /// Declare a family of gauges with given label names. Series are created in this registry on first use
+        /// </summary>
+        /// <param name="labelNames">label names, values for which are given to Family::withLabelValues in same order</param>
+        /// <returns>family which creates series while the registry is alive, and throws std::logic_error afterwards</returns>
+        Family<Gauge> getGaugeFamily(const std::string& name, const std::vector<std::string>& labelNames, GaugeKind kind = GaugeKind::Floating, Sharding sharding = Sharding::None)
+        {
+            std::weak_ptr<IRegistry> registry = shared_from_this();
+            return getFamily(name, labelNames, [registry, name, kind, sharding](const Labels& labels) { return lock(registry)->getGauge(name, labels, kind, sharding).raw(); });
+        }
+
+        /// <summary>
+        /// Declare a family of histograms with given label names. Series are created in this registry on first use
+        /// </summary>
+        /// <param name="labelNames">label names, values for which are given to Family::withLabelValues in same order</param>
+        /// <returns>family which creates series while the registry is alive, and throws std::logic_error afterwards</returns>
+        Family<Histogram> getHistogramFamily(const std::string& name, const std::vector<std::string>& labelNames, const std::vector<double>& bounds = { 100., 200., 300., 400., 500. }, Sharding sharding = Sharding::None)
+        {
+            std::weak_ptr<IRegistry> registry = shared_from_this();
+            return getFamily(name, labelNames, [registry, name, bounds, sharding](const Labels& labels) { return lock(registry)->getHistogram(name, labels, bounds, sharding).raw(); });
+        }
+
+        /// <summary>
+        /// Declare a family of series with given name and label names. Series removed from the registry are removed from the family as well
+        /// </summary>
+        /// <param name="create">called with full labels for series missing from the family</param>
+        virtual std::shared_ptr<IFamily> getFamily(const std::string& name, const std::vector<std::string>& labelNames, std::function<std::shared_ptr<IMetric>(const Labels&)> create) = 0;
 
         /// <summary>
         /// Register an existing metric wrapper object with the registry
@@ -71,6 +251,20 @@ namespace Metrics
         /// <returns></returns>
         virtual bool add(std::shared_ptr<IMetric> metric, const std::string& name, const Labels& labels = {}) = 0;
 
+        /// <summary>
+        /// Remove a series from the registry. Metric objects held by callers stay valid but are no longer reported;
+        /// a later get creates a new series. Series referenced by handles from getCounterRef and getGaugeRef are not removed,
+        /// so that handles stay valid for the lifetime of the registry
+        /// </summary>
+        /// <returns>true if series was present</returns>
+        virtual bool remove(const std::string& name, const Labels& labels = {}) = 0;
+
+        /// <summary>
+        /// Remove series idle for longer than RegistryOptions::expireAfter. Called by sinks before each collection;
+        /// serialization functions do not call it
+        /// </summary>
+        virtual void expire() = 0;
+
         /// <summary>
         /// Sets metric description to later send to sinks
         /// </summary>
@@ -81,6 +275,58 @@ namespace Metrics
         virtual ~IRegistry() = 0;
     };
 
+    /// <summary>
+    /// Settings of a registry created by createRegistry
+    /// </summary>
+    struct RegistryOptions
+    {
+        /// <summary>
+        /// Number of partitions metric names are distributed across by hash. Each partition has its own lock,
+        /// so that series with different names can be created concurrently, e.g. std::thread::hardware_concurrency()
+        /// for registries populated from many threads
+        /// </summary>
+        size_t shards;
+
+        /// <summary>
+        /// Time after which a series whose value did not change is removed, e.g. to drop series of finished requests or
+        /// departed clients. Changes are detected when series are collected or expire is called, so the period between
+        /// collections should be well below it. It does not depend on the number of sinks collecting the registry.
+        /// Series from getCounterRef, getGaugeRef and add are never expired, nor are series whose metric objects are
+        /// held outside the registry, e.g. by callers or LocalCounter. Zero disables expiry
+        /// </summary>
+        std::chrono::steady_clock::duration expireAfter;
+
+        /// <summary>
+        /// Maximum number of series in the registry. Once reached, lookups of new label sets return a series
+        /// labelled {overflow="true"} in the same group instead, and are counted by metrics_rejected_series_total.
+        /// Overflow series, at most one per name, and metrics_rejected_series_total are not counted. 0 disables the cap
+        /// </summary>
+        size_t maxSeries;
+
+        /// <summary>
+        /// Maximum number of series with the same name, handled in the same way as maxSeries. 0 disables the cap
+        /// </summary>
+        size_t maxSeriesPerGroup;
+
+        RegistryOptions() : shards(1), expireAfter(std::chrono::steady_clock::duration::zero()), maxSeries(0), maxSeriesPerGroup(0) {}
+    };
+
     METRICS_EXPORT std::shared_ptr<IRegistry> defaultRegistry();
     METRICS_EXPORT std::shared_ptr<IRegistry> createRegistry();
+    METRICS_EXPORT std::shared_ptr<IRegistry> createRegistry(const RegistryOptions& options);
+
+    /// <summary>
+    /// Creates a view of a registry which reports its metrics with a name prefix and constant labels, e.g. {service, zone}.
+    /// These are added when metrics are collected, without being stored in every series. Metrics are created and looked up
+    /// through the view by their own names and labels
+    /// </summary>
+    /// <param name="prefix">prepended to names of all metrics, e.g. "billing_"</param>
+    /// <param name="labels">labels added to all series; series should not have labels with same names</param>
+    METRICS_EXPORT std::shared_ptr<IRegistry> createRegistryView(std::shared_ptr<IRegistry> registry, const std::string& prefix, const Labels& labels = {});
+
+    /// <summary>
+    /// Creates a read-only registry which exposes metrics of several registries as one, e.g. to a single sink.
+    /// Creating, adding or removing metrics through it throws logic_error
+    /// </summary>
+    METRICS_EXPORT std::shared_ptr<IRegistry> createCompositeRegistry(const std::vector<std::shared_ptr<IRegistry>>& registries);
 }
@@ -0,0 +1,288 @@
+#pragma once
+
+#include <metrics_export.h>
+#include <metrics/metric.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Metrics
+{
+    /// <summary>
+    /// Label of a registry series. Strings are owned by the registry
+    /// </summary>
+    struct LabelRef
+    {
+        const std::string* name;
+        const std::string* value;
+    };
+
+    /// <summary>
+    /// Range of labels of a snapshot series, sorted by name
+    /// </summary>
+    class LabelRange
+    {
+    private:
+        const LabelRef* m_begin;
+        const LabelRef* m_end;
+
+    public:
+        LabelRange(const LabelRef* begin, const LabelRef* end) : m_begin(begin), m_end(end) {}
+
+        const LabelRef* begin() const { return m_begin; }
+        const LabelRef* end() const { return m_end; }
+        size_t size() const { return m_end - m_begin; }
+        bool empty() const { return m_begin == m_end; }
+
+        /// <summary>
+        /// Whether range has a label with given name. Constant labels of a group which a series has are
+        /// shadowed by labels of the series, and are not reported for it
+        /// </summary>
+        bool contains(const std::string& name) const
+        {
+            const LabelRef* it = std::lower_bound(m_begin, m_end, name, [](const LabelRef& label, const std::string& n) { return *label.name < n; });
+            return it != m_end && *it->name == name;
+        }
+    };
+
+    /// <summary>
+    /// Series of a registry collected in one pass, stored as flat columns: groups, then labels, metric and
+    /// counter or gauge value of each series. Clearing keeps capacity, so a snapshot reused across collections
+    /// does not allocate memory once it has grown to the size of the registry.
+    /// Strings referenced by a snapshot are valid while the registry is alive, and label strings and
+    /// descriptions until the snapshot is cleared, even if series are removed meanwhile
+    /// </summary>
+    class RegistrySnapshot
+    {
+    public:
+        struct Group
+        {
+            const std::string* name;
+            const std::string* description; // nullptr if not set
+            TypeCode type;
+            size_t begin; // series range
+            size_t end;
+
+            // Set by registry views: prepended to name (nullptr if none), and labels of all series of the group,
+            // unless shadowed by a series label with the same name
+            const std::string* prefix;
+            const LabelRef* labelsBegin;
+            const LabelRef* labelsEnd;
+
+            LabelRange labels() const { return LabelRange(labelsBegin, labelsEnd); }
+
+            /// <summary>
+            /// Compares full names, i.e. prefix followed by name
+            /// </summary>
+            int compare(const Group& other) const
+            {
+                static const std::string empty;
+                const std::string& p1 = prefix ? *prefix : empty;
+                const std::string& p2 = other.prefix ? *other.prefix : empty;
+                const size_t size1 = p1.size() + name->size();
+                const size_t size2 = p2.size() + other.name->size();
+                for (size_t i = 0; i < size1 && i < size2; i++) {
+                    const char c1 = i < p1.size() ? p1[i] : (*name)[i - p1.size()];
+                    const char c2 = i < p2.size() ? p2[i] : (*other.name)[i - p2.size()];
+                    if (c1 != c2)
+                        return (unsigned char)c1 < (unsigned char)c2 ? -1 : 1;
+                }
+                return size1 < size2 ? -1 : (size1 > size2 ? 1 : 0);
+            }
+        };
+
+    private:
+        union Value
+        {
+            uint64_t counter;
+            double gauge;
+        };
+
+        std::vector<Group> m_groups;
+        std::vector<size_t> m_labelEnds;
+        std::vector<LabelRef> m_labels;
+        std::vector<std::shared_ptr<IMetric>> m_metrics;
+        std::vector<Value> m_values;
+        std::vector<std::shared_ptr<const void>> m_pins;
+        uint64_t m_generation;
+
+    public:
+        RegistrySnapshot() : m_generation(0) {}
+
+        void clear()
+        {
+            m_groups.clear();
+            m_labelEnds.clear();
+            m_labels.clear();
+            m_metrics.clear();
+            m_values.clear();
+            m_pins.clear();
+        }
+
+        /// <summary>
+        /// Clear, including the generation. Used by IRegistry::snapshot
+        /// </summary>
+        void reset()
+        {
+            clear();
+            m_generation = 0;
+        }
+
+        /// <summary>
+        /// Record generation allocated by a registry for collecting into the snapshot. Snapshot generation is
+        /// the earliest one recorded, so that a snapshot collected from several registries reports changes
+        /// made during its collection at least once, possibly twice. Used by registry implementations
+        /// </summary>
+        void addGeneration(uint64_t generation)
+        {
+            if (m_generation == 0 || generation < m_generation)
+                m_generation = generation;
+        }
+
+        /// <summary>
+        /// Keep an object alive until the snapshot is cleared, e.g. strings referenced by it. Used by registry implementations
+        /// </summary>
+        void keepAlive(std::shared_ptr<const void> pin)
+        {
+            m_pins.push_back(std::move(pin));
+        }
+
+        /// <summary>
+        /// Start a group; series added afterwards belong to it. Used by registry implementations
+        /// </summary>
+        void addGroup(const std::string* name, const std::string* description, TypeCode type)
+        {
+            m_groups.push_back(Group{ name, description, type, m_metrics.size(), m_metrics.size(), nullptr, nullptr, nullptr });
+        }
+
+        /// <summary>
+        /// Set name prefix and constant labels of groups starting from given index. Used by registry views
+        /// </summary>
+        void decorateGroups(size_t first, const std::string* prefix, const LabelRef* labelsBegin, const LabelRef* labelsEnd)
+        {
+            for (size_t i = first; i < m_groups.size(); i++) {
+                m_groups[i].prefix = prefix;
+                m_groups[i].labelsBegin = labelsBegin;
+                m_groups[i].labelsEnd = labelsEnd;
+            }
+        }
+
+        /// <summary>
+        /// Add series to the last group, reading counter or gauge value. Used by registry implementations
+        /// </summary>
+        void addSeries(const LabelRef* begin, const LabelRef* end, std::shared_ptr<IMetric> metric)
+        {
+            Value value;
+            value.counter = 0;
+            if (metric->type() == TypeCode::Counter)
+                value.counter = static_cast<const ICounterValue&>(*metric).value();
+            else if (metric->type() == TypeCode::Gauge)
+                value.gauge = static_cast<const IGaugeValue&>(*metric).value();
+            m_labels.insert(m_labels.end(), begin, end);
+            m_labelEnds.push_back(m_labels.size());
+            m_metrics.push_back(std::move(metric));
+            m_values.push_back(value);
+            m_groups.back().end = m_metrics.size();
+        }
+
+        /// <summary>
+        /// Order groups starting from given index by full name. Used by registry implementations which collect groups out of order
+        /// </summary>
+        void sortGroups(size_t first = 0)
+        {
+            std::stable_sort(m_groups.begin() + first, m_groups.end(), [](const Group& l, const Group& r) { return l.compare(r) < 0; });
+        }
+
+        /// <summary>
+        /// Remove series of groups starting from given index for which remove(group index, series) returns true,
+        /// and groups left without series. The predicate is called for groups and their series in order, before
+        /// anything is removed. Used by registry implementations which merge groups
+        /// </summary>
+        template <typename Predicate>
+        void removeSeries(size_t first, Predicate remove)
+        {
+            size_t base = m_metrics.size();
+            for (size_t i = first; i < m_groups.size(); i++)
+                base = std::min(base, m_groups[i].begin);
+
+            std::vector<bool> removed(m_metrics.size() - base);
+            bool any = false;
+            for (size_t i = first; i < m_groups.size(); i++)
+                for (size_t series = m_groups[i].begin; series < m_groups[i].end; series++)
+                    any |= removed[series - base] = remove(i, series);
+            if (!any)
+                return;
+
+            // Series of sorted groups are not in group order, so the columns are rebuilt
+            const size_t labelBase = base == 0 ? 0 : m_labelEnds[base - 1];
+            std::vector<size_t> labelEnds;
+            std::vector<LabelRef> labels;
+            std::vector<std::shared_ptr<IMetric>> metrics;
+            std::vector<Value> values;
+            size_t kept = first;
+            for (size_t i = first; i < m_groups.size(); i++) {
+                Group group = m_groups[i];
+                const size_t begin = base + metrics.size();
+                for (size_t series = group.begin; series < group.end; series++) {
+                    if (removed[series - base])
+                        continue;
+                    const LabelRange range = this->labels(series);
+                    labels.insert(labels.end(), range.begin(), range.end());
+                    labelEnds.push_back(labelBase + labels.size());
+                    metrics.push_back(std::move(m_metrics[series]));
+                    values.push_back(m_values[series]);
+                }
+                if (group.begin != group.end && begin == base + metrics.size())
+                    continue;
+                group.begin = begin;
+                group.end = base + metrics.size();
+                m_groups[kept++] = group;
+            }
+            m_groups.erase(m_groups.begin() + kept, m_groups.end());
+            m_labelEnds.resize(base);
+            m_labelEnds.insert(m_labelEnds.end(), labelEnds.begin(), labelEnds.end());
+            m_labels.resize(labelBase);
+            m_labels.insert(m_labels.end(), labels.begin(), labels.end());
+            m_metrics.resize(base);
+            m_metrics.insert(m_metrics.end(), std::make_move_iterator(metrics.begin()), std::make_move_iterator(metrics.end()));
+            m_values.resize(base);
+            m_values.insert(m_values.end(), values.begin(), values.end());
+        }
+
+        /// <summary>
+        /// Collection generation of the snapshot, to be passed to IRegistry::snapshot to collect later changes.
+        /// 0 if no registry was collected
+        /// </summary>
+        uint64_t generation() const { return m_generation; }
+
+        size_t groupCount() const { return m_groups.size(); }
+        const Group& group(size_t index) const { return m_groups[index]; }
+
+        /// <summary>
+        /// Number of series
+        /// </summary>
+        size_t size() const { return m_metrics.size(); }
+
+        LabelRange labels(size_t series) const
+        {
+            const LabelRef* data = m_labels.data();
+            return LabelRange(data + (series == 0 ? 0 : m_labelEnds[series - 1]), data + m_labelEnds[series]);
+        }
+
+        const std::shared_ptr<IMetric>& metric(size_t series) const { return m_metrics[series]; }
+
+        /// <summary>
+        /// Value of a counter series at the time of snapshot
+        /// </summary>
+        uint64_t counter(size_t series) const { return m_values[series].counter; }
+
+        /// <summary>
+        /// Value of a gauge series at the time of snapshot
+        /// </summary>
+        double gauge(size_t series) const { return m_values[series].gauge; }
+    };
+}
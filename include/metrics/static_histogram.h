@@ -0,0 +1,140 @@
+#pragma once
+
+#include <metrics/metric.h>
+
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <ratio>
+#include <vector>
+
+namespace Metrics
+{
+    namespace Detail
+    {
+        template<typename TUnit, intmax_t... Bounds> struct StaticBuckets;
+
+        template<typename TUnit> struct StaticBuckets<TUnit>
+        {
+            static size_t find(double) { return 0; }
+            static constexpr bool sorted(intmax_t) { return true; }
+        };
+
+        template<typename TUnit, intmax_t Bound, intmax_t... Rest> struct StaticBuckets<TUnit, Bound, Rest...>
+        {
+            static constexpr double bound() { return (double)Bound * TUnit::num / TUnit::den; }
+
+            // Number of bounds below value - sum of comparisons, so that no branches are generated
+            static size_t find(double value) { return (value > bound() ? 1 : 0) + StaticBuckets<TUnit, Rest...>::find(value); }
+
+            static constexpr bool sorted(intmax_t previous) { return previous < Bound && StaticBuckets<TUnit, Rest...>::sorted(Bound); }
+        };
+    }
+
+    /// <summary>
+    /// Histogram implementation with bounds fixed at compile time. Declared final, so that calls
+    /// through StaticHistogram are resolved statically and inlined
+    /// </summary>
+    template<typename TUnit, intmax_t... Bounds> class StaticHistogramValue final : public IHistogram
+    {
+    private:
+        typedef Detail::StaticBuckets<TUnit, Bounds...> buckets_t;
+        static constexpr size_t Size = sizeof...(Bounds) + 1;
+
+        std::atomic<uint64_t> m_counts[Size];
+        std::atomic<double> m_sum;
+        ModificationStamp m_modified;
+
+    public:
+        StaticHistogramValue() : m_sum(0.)
+        {
+            for (auto& c : m_counts)
+                c.store(0, std::memory_order_relaxed);
+        }
+
+        StaticHistogramValue(const StaticHistogramValue&) = delete;
+
+        IHistogram& observe(double value) override
+        {
+            m_counts[buckets_t::find(value)].fetch_add(1, std::memory_order_relaxed);
+            double oldv = m_sum.load(std::memory_order_relaxed);
+            while (!m_sum.compare_exchange_weak(oldv, oldv + value, std::memory_order_relaxed))
+                ;
+            m_modified.touch();
+            return *this;
+        }
+
+        IHistogram& observeMany(const double* values, size_t count) override
+        {
+            uint64_t counts[Size] = {};
+            double sum = 0;
+            for (size_t i = 0; i < count; i++) {
+                counts[buckets_t::find(values[i])]++;
+                sum += values[i];
+            }
+            for (size_t i = 0; i < Size; i++)
+                if (counts[i] != 0)
+                    m_counts[i].fetch_add(counts[i], std::memory_order_relaxed);
+            double oldv = m_sum.load(std::memory_order_relaxed);
+            while (!m_sum.compare_exchange_weak(oldv, oldv + sum, std::memory_order_relaxed))
+                ;
+            m_modified.touch();
+            return *this;
+        }
+
+        std::vector<std::pair<double, uint64_t>> values() const override
+        {
+            const double bounds[Size] = { (double)Bounds * TUnit::num / TUnit::den..., std::numeric_limits<double>::infinity() };
+            std::vector<std::pair<double, uint64_t>> result;
+            result.reserve(Size);
+            uint64_t running_total = 0;
+            for (size_t i = 0; i < Size; i++) {
+                running_total += m_counts[i].load(std::memory_order_acquire);
+                result.emplace_back(bounds[i], running_total);
+            }
+            return result;
+        }
+
+        uint64_t count() const override
+        {
+            uint64_t result = 0;
+            for (auto& c : m_counts)
+                result += c.load(std::memory_order_acquire);
+            return result;
+        }
+
+        double sum() const override { return m_sum.load(std::memory_order_acquire); }
+        ModificationStamp* modificationStamp() override { return &m_modified; }
+    };
+
+    /// <summary>
+    /// Histogram with bounds known at compile time. Bounds are integers multiplied by TUnit,
+    /// e.g. StaticHistogram&lt;std::milli, 1, 5, 10&gt; has bounds 0.001, 0.005 and 0.01.
+    /// Bucket is selected with an unrolled comparison chain without virtual calls.
+    /// Can be added to a registry and serialized like any other histogram
+    /// </summary>
+    template<typename TUnit, intmax_t... Bounds> class StaticHistogram
+    {
+        static_assert(sizeof...(Bounds) > 0, "StaticHistogram requires at least one bound");
+        static_assert(Detail::StaticBuckets<TUnit, Bounds...>::sorted(std::numeric_limits<intmax_t>::min()), "StaticHistogram bounds must be strictly increasing");
+
+    private:
+        std::shared_ptr<StaticHistogramValue<TUnit, Bounds...>> m_value;
+
+    public:
+        typedef IHistogram value_type;
+
+        StaticHistogram() : m_value(std::make_shared<StaticHistogramValue<TUnit, Bounds...>>()) {}
+        StaticHistogram(const StaticHistogram&) = default;
+        StaticHistogram(StaticHistogram&&) = default;
+
+        StaticHistogram& observe(double value) { m_value->observe(value); return *this; }
+        StaticHistogram& observeMany(const double* values, size_t count) { m_value->observeMany(values, count); return *this; }
+        uint64_t count() const { return m_value->count(); }
+        double sum() const { return m_value->sum(); }
+        std::vector<std::pair<double, uint64_t>> values() const { return m_value->values(); }
+
+        std::shared_ptr<IMetric> raw() { return m_value; }
+    };
+}
@@ -8,6 +8,12 @@
 namespace Metrics {
     namespace Statsd {
         METRICS_EXPORT std::string serialize(std::shared_ptr<IRegistry> registry);
+
+        /// <summary>
+        /// Serialize only series changed or created since an earlier collection
+        /// </summary>
+        /// <param name="since">generation returned by previous call, 0 initially to serialize all series. Advanced by the call</param>
+        METRICS_EXPORT std::string serialize(std::shared_ptr<IRegistry> registry, uint64_t& since);
         METRICS_EXPORT std::shared_ptr<IOnDemandSink> createUdpSink(const std::string& host, const std::string& port);
         METRICS_EXPORT std::shared_ptr<IOnDemandSink> createTcpSink(const std::string& host, const std::string& port);
     }
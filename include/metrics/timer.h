@@ -1,9 +1,15 @@
 #pragma once
 #include <metrics/metric.h>
 #include <chrono>
+#include <type_traits>
 
 namespace Metrics
 {
+    /// <summary>
+    /// Records time elapsed between construction and destruction, counted in TDurationUnit. Histograms receive integral
+    /// counts through IHistogram::observeInteger, so for an integer histogram TDurationUnit must be its integer unit,
+    /// e.g. Timer&lt;std::chrono::nanoseconds&gt; for a histogram with unit 1e-9
+    /// </summary>
     template<typename TDurationUnit=std::chrono::seconds> class Timer : IMetricVisitor {
     private:
         std::shared_ptr<IMetric> m_metric;
@@ -27,6 +33,16 @@ namespace Metrics
             return std::chrono::duration_cast<TDurationUnit>(now - m_start);
         }
     private:
+        template<typename TRep> static void observe(IHistogram& v, TRep count, std::true_type)
+        {
+            v.observeInteger(count < 0 ? 0 : static_cast<uint64_t>(count));
+        }
+
+        template<typename TRep> static void observe(IHistogram& v, TRep count, std::false_type)
+        {
+            v.observe(count);
+        }
+
         virtual void visit(ICounterValue& v) override
         {
             v += elapsed().count();
@@ -43,6 +59,11 @@ namespace Metrics
         }
 
         virtual void visit(IHistogram& v) override
+        {
+            observe(v, elapsed().count(), std::is_integral<typename TDurationUnit::rep>());
+        }
+
+        virtual void visit(IExponentialHistogram& v) override
         {
             v.observe(elapsed().count());
         }
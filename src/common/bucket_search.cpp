@@ -0,0 +1,119 @@
+#include "common/bucket_search.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define METRICS_SIMD_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(METRICS_SIMD_X86) && (defined(__GNUC__) || defined(__clang__))
+#define METRICS_TARGET(isa) __attribute__((target(isa)))
+#else
+#define METRICS_TARGET(isa)
+#endif
+
+using namespace std;
+
+namespace Metrics {
+    // Kernels process bounds in chunks of this many doubles; bounds are padded accordingly
+    constexpr size_t ChunkSize = 4;
+
+    typedef size_t(*SearchFunction)(const double* bounds, size_t size, double value);
+
+    static size_t searchScalar(const double* bounds, size_t size, double value)
+    {
+        return lower_bound(bounds, bounds + size, value) - bounds;
+    }
+
+#ifdef METRICS_SIMD_X86
+    // Bounds are sorted, so comparison masks are always of form 0..01..1 - number of set bits
+    // is number of bounds in the chunk below value. Search stops at first chunk which is not full
+    METRICS_TARGET("sse2")
+    static size_t searchSse2(const double* bounds, size_t size, double value)
+    {
+        const __m128d v = _mm_set1_pd(value);
+        for (size_t i = 0; i < size; i += 2) {
+            int mask = _mm_movemask_pd(_mm_cmplt_pd(_mm_load_pd(bounds + i), v));
+            if (mask != 0x3)
+                return i + (mask & 1);
+        }
+        return size;
+    }
+
+    METRICS_TARGET("avx")
+    static size_t searchAvx(const double* bounds, size_t size, double value)
+    {
+        static const uint8_t bits[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+        const __m256d v = _mm256_set1_pd(value);
+        for (size_t i = 0; i < size; i += 4) {
+            int mask = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_load_pd(bounds + i), v, _CMP_LT_OQ));
+            if (mask != 0xF)
+                return i + bits[mask];
+        }
+        return size;
+    }
+
+    static bool cpuSupportsAvx()
+    {
+#if defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 1);
+        const bool osxsave = (info[2] & (1 << 27)) != 0;
+        const bool avx = (info[2] & (1 << 28)) != 0;
+        // Check that OS saves YMM registers on context switch
+        return osxsave && avx && (_xgetbv(0) & 0x6) == 0x6;
+#else
+        return __builtin_cpu_supports("avx");
+#endif
+    }
+
+    static bool cpuSupportsSse2()
+    {
+#if defined(_MSC_VER) || defined(__x86_64__)
+        return true; // Part of x86-64 baseline
+#else
+        return __builtin_cpu_supports("sse2");
+#endif
+    }
+#endif
+
+    static SearchFunction selectSearch()
+    {
+#ifdef METRICS_SIMD_X86
+        if (cpuSupportsAvx())
+            return searchAvx;
+        if (cpuSupportsSse2())
+            return searchSse2;
+#endif
+        return searchScalar;
+    }
+
+    BucketBounds::BucketBounds(const vector<double>& bounds) :
+        m_size(bounds.size()),
+        m_paddedSize((bounds.size() + ChunkSize - 1) / ChunkSize * ChunkSize)
+    {
+        // Align to 32 bytes for vector loads - operator new does not honor over-alignment before C++17
+        const size_t alignment = ChunkSize * sizeof(double);
+        m_buffer.reset(new unsigned char[m_paddedSize * sizeof(double) + alignment]);
+        auto address = reinterpret_cast<uintptr_t>(m_buffer.get());
+        m_data = reinterpret_cast<double*>((address + alignment - 1) & ~(uintptr_t)(alignment - 1));
+
+        copy(bounds.begin(), bounds.end(), m_data);
+        fill(m_data + m_size, m_data + m_paddedSize, numeric_limits<double>::infinity());
+    }
+
+    size_t BucketBounds::find(double value) const
+    {
+        // Selected on first use, so that histograms created during static initialization work too
+        static const SearchFunction s_search = selectSearch();
+
+        // Real bounds end with +Inf, so the padding is never selected
+        return s_search(m_data, m_paddedSize, value);
+    }
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace Metrics {
+    // Sorted histogram bounds stored in an aligned array padded with +Inf to a multiple of
+    // the widest vector width, so that the search kernels never need a scalar tail loop
+    class BucketBounds {
+    private:
+        size_t m_size;
+        size_t m_paddedSize;
+        std::unique_ptr<unsigned char[]> m_buffer;
+        double* m_data;
+
+    public:
+        // Bounds must be sorted, unique and end with +Inf
+        BucketBounds(const std::vector<double>& bounds);
+        BucketBounds(const BucketBounds&) = delete;
+        BucketBounds& operator=(const BucketBounds&) = delete;
+
+        size_t size() const { return m_size; }
+        double operator[](size_t index) const { return m_data[index]; }
+
+        // Index of the first bound which is not less than value - same result as std::lower_bound
+        size_t find(double value) const;
+    };
+}
@@ -0,0 +1,81 @@
+#include "common/buckets.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+using namespace std;
+
+namespace Metrics {
+    BucketLayout::BucketLayout(Kind kind, vector<double> bounds, double start, double scale) :
+        m_kind(kind),
+        m_bounds(move(bounds)),
+        m_start(start),
+        m_scale(scale)
+    {
+        if (m_kind == Kind::Explicit)
+            m_search.reset(new BucketBounds(m_bounds));
+    }
+
+    size_t BucketLayout::adjust(size_t estimate, double value) const
+    {
+        // Arithmetic estimate may be off by one due to rounding - correct it against actual bounds,
+        // so that the result is always the same as a search would give. Caller guarantees that
+        // value lies within (bounds[0], bounds[size - 2]]
+        size_t index = min(max(estimate, (size_t)1), m_bounds.size() - 2);
+        while (m_bounds[index - 1] >= value)
+            index--;
+        while (m_bounds[index] < value)
+            index++;
+        return index;
+    }
+
+    static vector<double> preprocessBounds(const vector<double>& input) {
+        vector<double> bounds;
+
+        // Reserve extra for +Inf
+        bounds.reserve(input.size() + 1);
+        copy(input.begin(), input.end(), back_inserter(bounds));
+
+        // Add mandatory +Inf bound
+        bounds.push_back(numeric_limits<double>::infinity());
+        sort(bounds.begin(), bounds.end());
+        auto last = unique(bounds.begin(), bounds.end());
+        bounds.erase(last, bounds.end());
+        return bounds;
+    }
+
+    shared_ptr<const IHistogramBuckets> makeBuckets(const vector<double>& bounds)
+    {
+        return make_shared<BucketLayout>(BucketLayout::Kind::Explicit, preprocessBounds(bounds));
+    }
+
+    shared_ptr<const IHistogramBuckets> makeLinearBuckets(double start, double width, size_t count)
+    {
+        if (!(width > 0) || count == 0)
+            throw logic_error("Linear buckets require positive width and count");
+
+        vector<double> bounds;
+        bounds.reserve(count + 1);
+        for (size_t i = 0; i < count; i++)
+            bounds.push_back(start + i * width);
+        bounds.push_back(numeric_limits<double>::infinity());
+        return make_shared<BucketLayout>(BucketLayout::Kind::Linear, move(bounds), start, width);
+    }
+
+    shared_ptr<const IHistogramBuckets> makeExponentialBuckets(double start, double factor, size_t count)
+    {
+        if (!(start > 0) || !(factor > 1) || count == 0)
+            throw logic_error("Exponential buckets require positive start, factor above 1 and positive count");
+
+        vector<double> bounds;
+        bounds.reserve(count + 1);
+        for (size_t i = 0; i < count; i++)
+            bounds.push_back(start * pow(factor, (double)i));
+        if (!isfinite(bounds.back()))
+            throw logic_error("Exponential buckets exceed range of double");
+        bounds.push_back(numeric_limits<double>::infinity());
+        return make_shared<BucketLayout>(BucketLayout::Kind::Exponential, move(bounds), start, 1. / log2(factor));
+    }
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <metrics/metric.h>
+
+#include "common/bucket_search.h"
+
+#include <cmath>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace Metrics {
+    // Immutable histogram bucket layout shared between histograms. Linear and exponential layouts
+    // compute the bucket index arithmetically; explicit bounds are searched with vector instructions
+    class BucketLayout final : public IHistogramBuckets {
+    public:
+        enum class Kind {
+            Explicit,
+            Linear,
+            Exponential
+        };
+
+    private:
+        const Kind m_kind;
+        const std::vector<double> m_bounds;
+
+        // Linear: start and width. Exponential: start and 1/log2(factor)
+        const double m_start;
+        const double m_scale;
+
+        // Padded copy of bounds for vector search. Only populated for explicit layouts
+        std::unique_ptr<BucketBounds> m_search;
+
+        size_t adjust(size_t estimate, double value) const;
+
+    public:
+        // Bounds must be sorted, unique and end with +Inf
+        BucketLayout(Kind kind, std::vector<double> bounds, double start = 0., double scale = 0.);
+        BucketLayout(const BucketLayout&) = delete;
+        BucketLayout& operator=(const BucketLayout&) = delete;
+
+        size_t size() const { return m_bounds.size(); }
+        double operator[](size_t index) const { return m_bounds[index]; }
+
+        const std::vector<double>& bounds() const override { return m_bounds; }
+        size_t bucket(double value) const override { return find(value); }
+
+        // Index of the first bound which is not less than value - same result as std::lower_bound
+        size_t find(double value) const
+        {
+            switch (m_kind) {
+            case Kind::Linear:
+                if (!(value > m_bounds[0]))
+                    return 0; // Also handles NaN
+                if (value > m_bounds[m_bounds.size() - 2])
+                    return m_bounds.size() - 1;
+                return adjust((size_t)((value - m_start) / m_scale) + 1, value);
+            case Kind::Exponential:
+                if (!(value > m_bounds[0]))
+                    return 0; // Also handles NaN
+                if (value > m_bounds[m_bounds.size() - 2])
+                    return m_bounds.size() - 1;
+                return adjust((size_t)(std::log2(value / m_start) * m_scale) + 1, value);
+            default:
+                return m_search->find(value);
+            }
+        }
+    };
+}
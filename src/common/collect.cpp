@@ -0,0 +1,44 @@
+#include <metrics/local.h>
+
+#include "common/collect.h"
+
+using namespace std;
+
+namespace Metrics {
+    struct ThreadSnapshot
+    {
+        RegistrySnapshot snapshot;
+        bool used = false;
+    };
+
+    static thread_local ThreadSnapshot t_snapshot;
+
+    CollectedSnapshot::CollectedSnapshot(IRegistry& registry, uint64_t since) :
+        m_owned(t_snapshot.used ? new RegistrySnapshot() : nullptr),
+        m_snapshot(m_owned ? m_owned.get() : &t_snapshot.snapshot)
+    {
+        // Nested collection on the thread, e.g. from a callback metric, collects into a snapshot of its own
+        t_snapshot.used = true;
+        try {
+            flushLocalMetrics();
+            registry.snapshot(*m_snapshot, since);
+        }
+        catch (...) {
+            release();
+            throw;
+        }
+    }
+
+    CollectedSnapshot::~CollectedSnapshot()
+    {
+        release();
+    }
+
+    void CollectedSnapshot::release()
+    {
+        if (m_owned)
+            return;
+        m_snapshot->clear();
+        t_snapshot.used = false;
+    }
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <metrics/registry.h>
+
+namespace Metrics {
+    // Snapshot of a registry collected for serialization, after flushing local metrics. The snapshot is reused
+    // by consecutive collections on the thread, and cleared on destruction - also if serialization throws - so
+    // that it holds neither metrics nor label strings of the registry between collections
+    class CollectedSnapshot
+    {
+    private:
+        std::unique_ptr<RegistrySnapshot> m_owned;
+        RegistrySnapshot* m_snapshot;
+
+        void release();
+
+    public:
+        CollectedSnapshot(IRegistry& registry, uint64_t since = 0);
+        ~CollectedSnapshot();
+
+        CollectedSnapshot(const CollectedSnapshot&) = delete;
+        CollectedSnapshot& operator=(const CollectedSnapshot&) = delete;
+
+        const RegistrySnapshot& operator*() const { return *m_snapshot; }
+        const RegistrySnapshot* operator->() const { return m_snapshot; }
+    };
+}
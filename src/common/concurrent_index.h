@@ -0,0 +1,262 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "common/epoch.h"
+
+namespace Metrics {
+    // 64-bit FNV-1a hash, built incrementally from several strings. Each string is followed by a
+    // separator byte which cannot occur in UTF-8, so that ("ab", "c") and ("a", "bc") differ
+    class KeyHash {
+    private:
+        uint64_t m_value;
+
+    public:
+        KeyHash() : m_value(0xcbf29ce484222325ull) { }
+
+        // Continues hashing from a previously computed value
+        explicit KeyHash(uint64_t value) : m_value(value) { }
+
+        KeyHash& add(const char* data, size_t size)
+        {
+            for (size_t i = 0; i < size; i++)
+                byte((unsigned char)data[i]);
+            byte(0xff);
+            return *this;
+        }
+
+        // Accepts std::string and StringView
+        template<typename TString> KeyHash& add(const TString& value) { return add(value.data(), value.size()); }
+
+        KeyHash& add(uint64_t value)
+        {
+            for (int i = 0; i < 8; i++)
+                byte((unsigned char)(value >> (i * 8)));
+            return *this;
+        }
+
+        KeyHash& byte(unsigned char value)
+        {
+            m_value = (m_value ^ value) * 0x100000001b3ull;
+            return *this;
+        }
+
+        uint64_t value() const { return m_value; }
+    };
+
+    // Hash index with lock-free lookups and insertions serialized by a lock, after split-ordered
+    // lists (O. Shalev, N. Shavit). All entries form one linked list sorted by bit-reversed hash;
+    // buckets are shortcuts into that list, so growing the table never moves entries. Removed
+    // entries are freed once no reader can reach them, so lookups must be made under an EpochGuard
+    // and values must not change after insertion
+    template<typename TValue> class ConcurrentIndex {
+    private:
+        struct Node {
+            const uint64_t order; // bit-reversed hash; odd for entries, even for bucket sentinels
+            std::atomic<Node*> next;
+
+            Node(uint64_t order) : order(order), next(nullptr) { }
+        };
+
+        struct Entry : Node {
+            const uint64_t hash;
+            const TValue value;
+
+            Entry(uint64_t hash, TValue value) : Node(reverse(hash) | 1), hash(hash), value(std::move(value)) { }
+        };
+
+        // Bucket array is split into segments of doubling size which are allocated once and never moved:
+        // segment 0 holds buckets 0 and 1, segment k holds buckets [2^k, 2^(k+1))
+        static constexpr size_t SegmentCount = 64;
+        static constexpr size_t MaxLoad = 2;
+        static constexpr size_t RetiredBatch = 64;
+
+        std::atomic<std::atomic<Node*>*> m_segments[SegmentCount];
+        std::atomic<size_t> m_buckets;
+        size_t m_size;
+        std::vector<Entry*> m_retired; // unlinked, but may be referenced by readers
+        std::mutex m_mutex;
+
+        static uint64_t reverse(uint64_t value)
+        {
+            value = ((value >> 1) & 0x5555555555555555ull) | ((value & 0x5555555555555555ull) << 1);
+            value = ((value >> 2) & 0x3333333333333333ull) | ((value & 0x3333333333333333ull) << 2);
+            value = ((value >> 4) & 0x0f0f0f0f0f0f0f0full) | ((value & 0x0f0f0f0f0f0f0f0full) << 4);
+            value = ((value >> 8) & 0x00ff00ff00ff00ffull) | ((value & 0x00ff00ff00ff00ffull) << 8);
+            value = ((value >> 16) & 0x0000ffff0000ffffull) | ((value & 0x0000ffff0000ffffull) << 16);
+            return (value >> 32) | (value << 32);
+        }
+
+        static size_t segmentOf(size_t bucket)
+        {
+            size_t segment = 0;
+            while (bucket >> (segment + 1))
+                segment++;
+            return segment;
+        }
+
+        static size_t segmentSize(size_t segment) { return segment == 0 ? 2 : size_t(1) << segment; }
+        static size_t segmentStart(size_t segment) { return segment == 0 ? 0 : size_t(1) << segment; }
+
+        std::atomic<Node*>& slot(size_t bucket) const
+        {
+            const size_t segment = segmentOf(bucket);
+            return m_segments[segment].load(std::memory_order_acquire)[bucket - segmentStart(segment)];
+        }
+
+        // Bucket sentinel, or that of the closest initialized parent. Bucket 0 is always initialized
+        Node* sentinel(size_t bucket) const
+        {
+            for (;;) {
+                Node* node = slot(bucket).load(std::memory_order_acquire);
+                if (node != nullptr)
+                    return node;
+                bucket &= ~(size_t(1) << segmentOf(bucket));
+            }
+        }
+
+        // Links node after the last node ordered before it. Must be called under m_mutex
+        void link(Node* start, Node* node)
+        {
+            Node* prev = start;
+            Node* next = prev->next.load(std::memory_order_relaxed);
+            while (next != nullptr && next->order < node->order) {
+                prev = next;
+                next = next->next.load(std::memory_order_relaxed);
+            }
+            node->next.store(next, std::memory_order_relaxed);
+            prev->next.store(node, std::memory_order_release);
+        }
+
+        // Must be called under m_mutex
+        Node* initialize(size_t bucket)
+        {
+            Node* node = slot(bucket).load(std::memory_order_relaxed);
+            if (node != nullptr)
+                return node;
+            Node* parent = initialize(bucket & ~(size_t(1) << segmentOf(bucket)));
+            node = new Node(reverse(bucket));
+            link(parent, node);
+            slot(bucket).store(node, std::memory_order_release);
+            return node;
+        }
+
+        template<typename TPredicate> const Entry* find(Node* start, uint64_t hash, TPredicate& predicate) const
+        {
+            const uint64_t order = reverse(hash) | 1;
+            Node* node = start->next.load(std::memory_order_acquire);
+            while (node != nullptr && node->order < order)
+                node = node->next.load(std::memory_order_acquire);
+            for (; node != nullptr && node->order == order; node = node->next.load(std::memory_order_acquire)) {
+                auto entry = static_cast<const Entry*>(node);
+                if (entry->hash == hash && predicate(entry->value))
+                    return entry;
+            }
+            return nullptr;
+        }
+
+    public:
+        ConcurrentIndex() : m_buckets(2), m_size(0)
+        {
+            for (auto& segment : m_segments)
+                segment.store(nullptr, std::memory_order_relaxed);
+            m_segments[0].store(new std::atomic<Node*>[2](), std::memory_order_relaxed);
+            slot(0).store(new Node(0), std::memory_order_relaxed);
+        }
+
+        ConcurrentIndex(const ConcurrentIndex&) = delete;
+        ConcurrentIndex& operator=(const ConcurrentIndex&) = delete;
+
+        ~ConcurrentIndex()
+        {
+            Node* node = slot(0).load(std::memory_order_relaxed);
+            while (node != nullptr) {
+                Node* next = node->next.load(std::memory_order_relaxed);
+                if (node->order & 1)
+                    delete static_cast<Entry*>(node);
+                else
+                    delete node;
+                node = next;
+            }
+            for (auto entry : m_retired)
+                delete entry;
+            for (auto& segment : m_segments)
+                delete[] segment.load(std::memory_order_relaxed);
+        }
+
+        // Value with given hash for which predicate returns true, or nullptr. Returned pointer
+        // is valid while the EpochGuard under which lookup was made is held
+        template<typename TPredicate> const TValue* find(uint64_t hash, TPredicate predicate) const
+        {
+            const size_t bucket = (size_t)hash & (m_buckets.load(std::memory_order_acquire) - 1);
+            const Entry* entry = find(sentinel(bucket), hash, predicate);
+            return entry ? &entry->value : nullptr;
+        }
+
+        // Inserts value unless one matching predicate exists already; returns the value stored in the index
+        template<typename TPredicate> const TValue& insert(uint64_t hash, TValue value, TPredicate predicate)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            const size_t buckets = m_buckets.load(std::memory_order_relaxed);
+            Node* start = initialize((size_t)hash & (buckets - 1));
+            if (const Entry* existing = find(start, hash, predicate))
+                return existing->value;
+
+            auto entry = new Entry(hash, std::move(value));
+            link(start, entry);
+
+            if (++m_size > buckets * MaxLoad && segmentOf(buckets) < SegmentCount) {
+                // New buckets are initialized lazily; until then lookups start from parent bucket
+                m_segments[segmentOf(buckets)].store(new std::atomic<Node*>[segmentSize(segmentOf(buckets))](), std::memory_order_release);
+                m_buckets.store(buckets * 2, std::memory_order_release);
+            }
+            return entry->value;
+        }
+
+        // Unlinks value with given hash for which predicate returns true. Memory is reclaimed in batches;
+        // call reclaim() when values must not be reachable by readers anymore
+        template<typename TPredicate> bool remove(uint64_t hash, TPredicate predicate)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            const uint64_t order = reverse(hash) | 1;
+            Node* prev = initialize((size_t)hash & (m_buckets.load(std::memory_order_relaxed) - 1));
+            for (Node* node = prev->next.load(std::memory_order_relaxed); node != nullptr && node->order <= order; prev = node, node = node->next.load(std::memory_order_relaxed)) {
+                auto entry = static_cast<Entry*>(node);
+                if (node->order != order || entry->hash != hash || !predicate(entry->value))
+                    continue;
+                // Readers positioned on the entry still follow its next pointer
+                prev->next.store(node->next.load(std::memory_order_relaxed), std::memory_order_release);
+                m_retired.push_back(entry);
+                m_size--;
+                if (m_retired.size() >= RetiredBatch)
+                    reclaimLocked();
+                return true;
+            }
+            return false;
+        }
+
+        // Frees removed entries after waiting for readers which may still reference them
+        void reclaim()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            reclaimLocked();
+        }
+
+    private:
+        void reclaimLocked()
+        {
+            if (m_retired.empty())
+                return;
+            EpochDomain::instance().synchronize();
+            for (auto entry : m_retired)
+                delete entry;
+            m_retired.clear();
+        }
+    };
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "common/sharding.h"
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+namespace Metrics {
+    // Epoch-based reclamation (K. Fraser) for data read without locks. Readers hold an EpochGuard
+    // while they may reference shared nodes; a writer unlinks nodes, calls synchronize() and may
+    // then free them, as no reader can still reach them. Readers count themselves per thread shard
+    // and per epoch parity, so entering a guard touches only the calling thread's cache line.
+    // A guard must not be held while acquiring a lock, since synchronize() may run under that lock
+    class EpochDomain {
+    private:
+        std::atomic<uint64_t> m_epoch;
+        ShardedArray<std::atomic<int64_t>> m_readers; // two counters per shard, one per epoch parity
+        std::mutex m_mutex;
+
+        EpochDomain() : m_epoch(0), m_readers(2) { }
+
+    public:
+        static EpochDomain& instance()
+        {
+            static EpochDomain s_domain;
+            return s_domain;
+        }
+
+        std::atomic<int64_t>* enter()
+        {
+            std::atomic<int64_t>* row = m_readers.local();
+            for (;;) {
+                const uint64_t epoch = m_epoch.load();
+                std::atomic<int64_t>* counter = row + (epoch & 1);
+                counter->fetch_add(1);
+                // Epoch advanced before reader was counted - writer may not wait for it, so retry in new epoch
+                if (m_epoch.load() == epoch)
+                    return counter;
+                counter->fetch_sub(1, std::memory_order_relaxed);
+            }
+        }
+
+        void leave(std::atomic<int64_t>* counter)
+        {
+            counter->fetch_sub(1, std::memory_order_release);
+        }
+
+        // Waits until all readers which may have observed nodes unlinked before this call have left
+        void synchronize()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            const uint64_t parity = m_epoch.fetch_add(1) & 1;
+            for (size_t shard = 0; shard < m_readers.shards(); shard++) {
+                while (m_readers.row(shard)[parity].load() != 0)
+                    std::this_thread::yield();
+            }
+        }
+    };
+
+    class EpochGuard {
+    private:
+        std::atomic<int64_t>* const m_counter;
+
+    public:
+        EpochGuard() : m_counter(EpochDomain::instance().enter()) { }
+        ~EpochGuard() { EpochDomain::instance().leave(m_counter); }
+
+        EpochGuard(const EpochGuard&) = delete;
+        EpochGuard& operator=(const EpochGuard&) = delete;
+    };
+}
@@ -0,0 +1,132 @@
+#include <metrics/family.h>
+
+#include "common/concurrent_index.h"
+#include "common/family.h"
+
+#include <algorithm>
+#include <mutex>
+#include <stdexcept>
+
+using namespace std;
+
+namespace Metrics {
+    class FamilyImpl : public IFamily {
+    private:
+        // Families of a registry refer to series weakly, so that the registry alone decides when
+        // series are released, e.g. by expiry. Standalone families own their series
+        struct Entry {
+            vector<string> values;
+            weak_ptr<IMetric> metric;
+            shared_ptr<IMetric> owned;
+        };
+
+        const vector<string> m_labelNames;
+        const function<shared_ptr<IMetric>(const Labels&)> m_create;
+        const function<bool(const IMetric&)> m_cacheable;
+        const bool m_owning;
+        ConcurrentIndex<Entry> m_index;
+        mutex m_mutex;
+
+        static uint64_t hashValues(const StringView* values, size_t count)
+        {
+            KeyHash hash;
+            for (size_t i = 0; i < count; i++)
+                hash.add(values[i]);
+            return hash.value();
+        }
+
+    public:
+        FamilyImpl(const vector<string>& labelNames, function<shared_ptr<IMetric>(const Labels&)> create, function<bool(const IMetric&)> cacheable, bool owning) :
+            m_labelNames(labelNames),
+            m_create(move(create)),
+            m_cacheable(move(cacheable)),
+            m_owning(owning)
+        {
+        }
+
+        const vector<string>& labelNames() const override { return m_labelNames; }
+
+        shared_ptr<IMetric> get(const StringView* values, size_t count) override
+        {
+            if (count != m_labelNames.size())
+                throw logic_error("Number of label values does not match label names");
+
+            const uint64_t hash = hashValues(values, count);
+            auto matches = [&](const Entry& entry) {
+                for (size_t i = 0; i < count; i++)
+                    if (values[i] != entry.values[i])
+                        return false;
+                return true;
+            };
+            {
+                EpochGuard guard;
+                if (const Entry* entry = m_index.find(hash, matches))
+                    if (auto metric = entry->metric.lock())
+                        return metric;
+            }
+
+            // Creation is serialized with removal, so that a series removed from registry meanwhile is not indexed
+            unique_lock<mutex> lock(m_mutex);
+            if (const Entry* entry = m_index.find(hash, matches)) {
+                if (auto metric = entry->metric.lock())
+                    return metric;
+                // Released by the registry before the family was told about it
+                m_index.remove(hash, matches);
+                m_index.reclaim();
+            }
+            Entry created;
+            Labels labels;
+            for (size_t i = 0; i < count; i++) {
+                created.values.push_back(values[i].str());
+                labels[m_labelNames[i]] = created.values.back();
+            }
+            auto metric = m_create(labels);
+            if (m_cacheable && !m_cacheable(*metric))
+                return metric;
+            created.metric = metric;
+            if (m_owning)
+                created.owned = metric;
+            m_index.insert(hash, move(created), matches);
+            return metric;
+        }
+
+        bool remove(const Labels& labels) override
+        {
+            if (labels.size() != m_labelNames.size())
+                return false;
+            vector<StringView> values;
+            for (const auto& name : m_labelNames) {
+                auto it = find_if(labels.cbegin(), labels.cend(), [&](const pair<string, string>& label) { return label.first == name; });
+                if (it == labels.cend())
+                    return false;
+                values.emplace_back(it->second);
+            }
+
+            unique_lock<mutex> lock(m_mutex);
+            const bool removed = m_index.remove(hashValues(values.data(), values.size()), [&](const Entry& entry) {
+                return equal(values.begin(), values.end(), entry.values.begin());
+            });
+            if (removed)
+                m_index.reclaim();
+            return removed;
+        }
+    };
+
+    IFamily::~IFamily() {}
+
+    shared_ptr<IFamily> makeFamily(const vector<string>& labelNames, function<shared_ptr<IMetric>(const Labels&)> create)
+    {
+        return makeFamily(labelNames, move(create), nullptr, true);
+    }
+
+    shared_ptr<IFamily> makeFamily(const vector<string>& labelNames, function<shared_ptr<IMetric>(const Labels&)> create, function<bool(const IMetric&)> cacheable, bool owning)
+    {
+        if (labelNames.empty())
+            throw logic_error("Family requires at least one label name");
+        auto sorted = labelNames;
+        sort(sorted.begin(), sorted.end());
+        if (adjacent_find(sorted.begin(), sorted.end()) != sorted.end())
+            throw logic_error("Family label names must be unique");
+        return make_shared<FamilyImpl>(labelNames, move(create), move(cacheable), owning);
+    }
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <metrics/family.h>
+
+namespace Metrics {
+    // Family which keeps in its index only series for which cacheable returns true, e.g. not series
+    // shared by several label sets. Other series are obtained from create on every lookup.
+    // Unless owning, indexed series are referenced weakly and are created again once released elsewhere
+    std::shared_ptr<IFamily> makeFamily(const std::vector<std::string>& labelNames, std::function<std::shared_ptr<IMetric>(const Labels&)> create, std::function<bool(const IMetric&)> cacheable, bool owning);
+}
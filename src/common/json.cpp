@@ -1,5 +1,7 @@
 #include <metrics/json.h>
 
+#include "common/collect.h"
+
 #include <boost/json.hpp>
 
 #include <sstream>
@@ -9,14 +11,21 @@ using namespace std;
 
 namespace Metrics {
     namespace Json {
-        json::object serialize(const string & name, const Labels & labels, const std::shared_ptr<IMetric> metric)
+        json::object serialize(const string & name, const RegistrySnapshot& snapshot, const RegistrySnapshot::Group& group, size_t series)
         {
+            const auto& metric = snapshot.metric(series);
             json::object serialized;
             serialized["name"] = name;
             json::object jlabels;
-            for (auto kv = labels.cbegin(); kv != labels.cend(); kv++)
+            const LabelRange own = snapshot.labels(series);
+            for (const auto& label : group.labels())
+            {
+                if (!own.contains(*label.name))
+                    jlabels[*label.name] = *label.value;
+            }
+            for (const auto& label : own)
             {
-                jlabels[kv->first] = kv->second;
+                jlabels[*label.name] = *label.value;
             }
             if (!jlabels.empty())
                 serialized["labels"] = jlabels;
@@ -25,11 +34,11 @@ namespace Metrics {
             {
             case TypeCode::Counter:
                 serialized["type"] = "counter";
-                serialized["value"] = std::static_pointer_cast<ICounterValue>(metric)->value();
+                serialized["value"] = snapshot.counter(series);
                 break;
             case TypeCode::Gauge:
                 serialized["type"] = "gauge";
-                serialized["value"] = std::static_pointer_cast<IGaugeValue>(metric)->value();
+                serialized["value"] = snapshot.gauge(series);
                 break;
             case TypeCode::Summary:
                 {
@@ -71,23 +80,58 @@ namespace Metrics {
                     serialized["buckets"] = buckets;
                 }
                 break;
+            case TypeCode::ExponentialHistogram:
+                {
+                    serialized["type"] = "exponential_histogram";
+
+                    auto s = std::static_pointer_cast<IExponentialHistogram>(metric);
+                    serialized["count"] = s->count();
+                    serialized["sum"] = s->sum();
+
+                    auto values = s->values();
+                    serialized["scale"] = values.scale;
+                    serialized["zeroCount"] = values.zeroCount;
+                    serialized["zeroThreshold"] = values.zeroThreshold;
+
+                    auto serializeBuckets = [](const vector<pair<int32_t, uint64_t>>& source) {
+                        json::array buckets;
+                        for (const auto& kv : source)
+                        {
+                            json::object v;
+                            v["index"] = kv.first;
+                            v["count"] = kv.second;
+                            buckets.emplace_back(v);
+                        }
+                        return buckets;
+                    };
+                    serialized["positive"] = serializeBuckets(values.positive);
+                    serialized["negative"] = serializeBuckets(values.negative);
+                }
+                break;
             }
 
             return serialized;
         }
 
-        METRICS_EXPORT std::string serializeJson(std::shared_ptr<IRegistry> registry)
+        // Calls visit for each series of a registry snapshot
+        template<typename TVisit> void collect(std::shared_ptr<IRegistry> registry, TVisit visit)
         {
-            json::array result;
-
-            auto names = registry->metricNames();
-            for (const auto& name : names)
+            const CollectedSnapshot collected(*registry);
+            const RegistrySnapshot& snapshot = *collected;
+            string name;
+            for (size_t i = 0; i < snapshot.groupCount(); i++)
             {
-                auto& group = registry->getGroup(name);
-                auto metrics = group.metrics();
-                for (const auto& metric : metrics)
-                    result.emplace_back(serialize(name, metric.first, metric.second));
+                const auto& group = snapshot.group(i);
+                name.assign(group.prefix ? *group.prefix : string()).append(*group.name);
+                for (size_t series = group.begin; series < group.end; series++)
+                    visit(serialize(name, snapshot, group, series));
             }
+        }
+
+        METRICS_EXPORT std::string serializeJson(std::shared_ptr<IRegistry> registry)
+        {
+            json::array result;
+            collect(registry, [&](json::object serialized) { result.emplace_back(move(serialized)); });
 
             std::stringstream out;
             out << result;
@@ -97,15 +141,7 @@ namespace Metrics {
         METRICS_EXPORT std::string serializeJsonl(std::shared_ptr<IRegistry> registry)
         {
             std::stringstream out;
-            auto names = registry->metricNames();
-            for (const auto& name : names)
-            {
-                auto& group = registry->getGroup(name);
-                auto metrics = group.metrics();
-                for (const auto& metric : metrics)
-                    out << serialize(name, metric.first, metric.second) << std::endl;
-            }
-
+            collect(registry, [&](const json::object& serialized) { out << serialized << std::endl; });
             return out.str();
         }
     }
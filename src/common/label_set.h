@@ -0,0 +1,233 @@
+#pragma once
+
+#include <metrics/labels.h>
+#include <metrics/snapshot.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace Metrics {
+    // Label names and values shared by all series of a registry. Each distinct string is stored once
+    // and its address serves as a stable identifier: interned strings are equal only if their pointers
+    // are, and can be read without lock. Strings are reference counted by intern and release.
+    // Released strings may still be referenced by snapshots, so they are freed by sweep only once
+    // no snapshot pinned before their release is alive
+    class SymbolTable {
+    private:
+        struct Symbol {
+            size_t references;
+            uint64_t released; // batch of last release
+        };
+
+        // Strings are partitioned by hash into stripes with separate locks
+        struct Stripe {
+            std::mutex mutex;
+            std::unordered_map<std::string, Symbol> symbols;
+        };
+
+        // Held by snapshots. Each token keeps the next one alive, so a snapshot keeps alive all tokens
+        // issued after it, and with them batches of strings released after it was pinned
+        struct Token {
+            std::shared_ptr<Token> next;
+
+            // Unlinks the chain iteratively, so that a long chain does not overflow the stack
+            ~Token()
+            {
+                std::shared_ptr<Token> token = std::move(next);
+                while (token && token.use_count() == 1)
+                    token = std::move(token->next);
+            }
+        };
+
+        // Strings released while token was current
+        struct Batch {
+            uint64_t id;
+            std::weak_ptr<Token> token;
+            std::vector<const std::string*> symbols;
+        };
+
+        const size_t m_count;
+        std::unique_ptr<Stripe[]> m_stripes;
+
+        std::mutex m_batchesMutex;
+        std::deque<Batch> m_batches; // oldest first, last one is current
+        std::shared_ptr<Token> m_current;
+        uint64_t m_nextBatch;
+
+        // Sweeps free batches in order, so that a string is erased only by the sweep of its last release
+        std::mutex m_sweepMutex;
+
+        Stripe& stripe(const std::string& value) const
+        {
+            return m_stripes[m_count == 1 ? 0 : std::hash<std::string>()(value) % m_count];
+        }
+
+    public:
+        SymbolTable(size_t stripes = 1) : m_count(stripes), m_stripes(new Stripe[stripes]), m_current(std::make_shared<Token>()), m_nextBatch(1)
+        {
+            m_batches.push_back(Batch{ m_nextBatch++, m_current, std::vector<const std::string*>() });
+        }
+
+        SymbolTable(const SymbolTable&) = delete;
+        SymbolTable& operator=(const SymbolTable&) = delete;
+
+        // Returns interned string equal to value, adding a reference to it
+        const std::string* intern(const std::string& value)
+        {
+            Stripe& stripe = this->stripe(value);
+            std::unique_lock<std::mutex> lock(stripe.mutex);
+            auto it = stripe.symbols.emplace(value, Symbol{ 0, 0 }).first;
+            it->second.references++;
+            return &it->first;
+        }
+
+        // Removes a reference added by intern. Unreferenced strings are freed by a later sweep
+        void release(const std::string* value)
+        {
+            Stripe& stripe = this->stripe(*value);
+            std::unique_lock<std::mutex> lock(stripe.mutex);
+            auto it = stripe.symbols.find(*value);
+            if (--it->second.references != 0)
+                return;
+            std::unique_lock<std::mutex> batches(m_batchesMutex);
+            it->second.released = m_batches.back().id;
+            m_batches.back().symbols.push_back(value);
+        }
+
+        // Keeps strings which are interned now valid while the result is held, even if they are released
+        std::shared_ptr<const void> pin()
+        {
+            sweep();
+            std::unique_lock<std::mutex> lock(m_batchesMutex);
+            std::shared_ptr<Token> pinned = m_current;
+            m_current = std::make_shared<Token>();
+            pinned->next = m_current;
+            m_batches.push_back(Batch{ m_nextBatch++, m_current, std::vector<const std::string*>() });
+            return pinned;
+        }
+
+        // Frees released strings which no snapshot may refer to anymore
+        void sweep()
+        {
+            std::unique_lock<std::mutex> sweep(m_sweepMutex);
+            std::vector<Batch> free;
+            {
+                std::unique_lock<std::mutex> lock(m_batchesMutex);
+                while (m_batches.size() > 1 && m_batches.front().token.expired()) {
+                    free.push_back(std::move(m_batches.front()));
+                    m_batches.pop_front();
+                }
+                // Current token is referenced by older ones only, so if it is not, no snapshot is alive.
+                // Current batch gets a new id, so that strings released again are not freed by this sweep
+                Batch& current = m_batches.back();
+                if (m_batches.size() == 1 && m_current.use_count() == 1 && !current.symbols.empty()) {
+                    free.push_back(Batch{ current.id, current.token, std::move(current.symbols) });
+                    current.symbols.clear();
+                    current.id = m_nextBatch++;
+                }
+            }
+            for (const Batch& batch : free) {
+                for (const std::string* value : batch.symbols) {
+                    Stripe& stripe = this->stripe(*value);
+                    std::unique_lock<std::mutex> lock(stripe.mutex);
+                    auto it = stripe.symbols.find(*value);
+                    if (it->second.references == 0 && it->second.released == batch.id)
+                        stripe.symbols.erase(it);
+                }
+            }
+        }
+    };
+
+    // Immutable set of interned labels, sorted by name. Stored as count followed by label pointers
+    // in a single allocation; an empty set allocates nothing
+    class LabelSet {
+    private:
+        struct Header {
+            size_t size;
+        };
+        static constexpr size_t Offset = (sizeof(Header) + alignof(LabelRef) - 1) / alignof(LabelRef) * alignof(LabelRef);
+
+        void* m_data;
+
+        LabelRef* data() const { return reinterpret_cast<LabelRef*>(static_cast<char*>(m_data) + Offset); }
+
+        explicit LabelSet(size_t size) : m_data(nullptr)
+        {
+            if (size == 0)
+                return;
+            m_data = ::operator new(Offset + size * sizeof(LabelRef));
+            static_cast<Header*>(m_data)->size = size;
+        }
+
+    public:
+        LabelSet(const Labels& labels, SymbolTable& symbols) : LabelSet(labels.size())
+        {
+            LabelRef* out = m_data ? data() : nullptr;
+            for (auto it = labels.cbegin(); it != labels.cend(); it++, out++) {
+                out->name = symbols.intern(it->first);
+                out->value = symbols.intern(it->second);
+            }
+        }
+
+        LabelSet(LabelSet&& other) : m_data(other.m_data) { other.m_data = nullptr; }
+        LabelSet(const LabelSet&) = delete;
+        LabelSet& operator=(const LabelSet&) = delete;
+
+        ~LabelSet() { ::operator delete(m_data); }
+
+        // Releases references added to strings when the set was built. Set must not be used afterwards
+        void release(SymbolTable& symbols) const
+        {
+            for (const LabelRef* label = begin(); label != end(); label++) {
+                symbols.release(label->name);
+                symbols.release(label->value);
+            }
+        }
+
+        size_t size() const { return m_data ? static_cast<const Header*>(m_data)->size : 0; }
+        const LabelRef* begin() const { return m_data ? data() : nullptr; }
+        const LabelRef* end() const { return begin() + size(); }
+
+        bool operator==(const Labels& labels) const
+        {
+            if (labels.size() != size())
+                return false;
+            auto it = labels.cbegin();
+            for (const LabelRef* label = begin(); label != end(); label++, it++)
+                if (*label->name != it->first || *label->value != it->second)
+                    return false;
+            return true;
+        }
+
+        // Same order as Labels, so that series are serialized in same order as before interning
+        bool operator<(const LabelSet& other) const
+        {
+            const LabelRef* l = begin();
+            const LabelRef* r = other.begin();
+            for (; l != end() && r != other.end(); l++, r++) {
+                if (l->name != r->name)
+                    return *l->name < *r->name;
+                if (l->value != r->value)
+                    return *l->value < *r->value;
+            }
+            return l == end() && r != other.end();
+        }
+
+        Labels labels() const
+        {
+            Labels result;
+            for (const LabelRef* label = begin(); label != end(); label++)
+                result[*label->name] = *label->value;
+            return result;
+        }
+    };
+}
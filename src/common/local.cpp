@@ -0,0 +1,64 @@
+#include <metrics/local.h>
+
+#include <algorithm>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_set>
+
+using namespace std;
+
+namespace Metrics
+{
+    // Live local metrics. Function-local statics, so that they are constructed before
+    // (and destroyed after) any local metric with static or thread storage duration
+    static mutex& localsMutex()
+    {
+        static mutex s_mutex;
+        return s_mutex;
+    }
+
+    static unordered_set<LocalMetric*>& locals()
+    {
+        static unordered_set<LocalMetric*> s_locals;
+        return s_locals;
+    }
+
+    LocalMetric::LocalMetric(uint64_t countThreshold, chrono::steady_clock::duration maxDelay) :
+        m_registered(false),
+        m_countThreshold(countThreshold),
+        m_checkInterval(max<uint64_t>(1, countThreshold / 16)),
+        m_maxDelay(maxDelay),
+        m_lastFlush(chrono::steady_clock::now())
+    {
+        if (countThreshold == 0)
+            throw logic_error("Local metric count threshold must be positive");
+    }
+
+    LocalMetric::~LocalMetric()
+    {
+        unregister();
+    }
+
+    void LocalMetric::enroll()
+    {
+        unique_lock<mutex> lock(localsMutex());
+        locals().insert(this);
+        m_registered = true;
+    }
+
+    void LocalMetric::unregister()
+    {
+        if (!m_registered)
+            return;
+        unique_lock<mutex> lock(localsMutex());
+        locals().erase(this);
+        m_registered = false;
+    }
+
+    void flushLocalMetrics()
+    {
+        unique_lock<mutex> lock(localsMutex());
+        for (auto local : locals())
+            local->flush();
+    }
+}
@@ -1,13 +1,21 @@
 #include <metrics/metric.h>
 
+#include "common/buckets.h"
+#include "common/sharding.h"
+
 #include <algorithm>
 #include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <limits>
 #include <list>
 #include <map>
 #include <mutex>
 #include <numeric>
+#include <stdexcept>
 #include <vector>
 #include <iterator>
+#include <cstring>
 
 using namespace std;
 
@@ -17,154 +25,460 @@ namespace Metrics
     void IGaugeValue::accept(IMetricVisitor& visitor) { visitor.visit(*this); }
     void ISummary::accept(IMetricVisitor& visitor) { visitor.visit(*this); }
     void IHistogram::accept(IMetricVisitor& visitor) { visitor.visit(*this); }
+    void IExponentialHistogram::accept(IMetricVisitor& visitor) { visitor.visit(*this); }
+
+    IHistogram& IHistogram::observeMany(const double* values, size_t count)
+    {
+        for (size_t i = 0; i < count; i++)
+            observe(values[i]);
+        return *this;
+    }
+
+    IHistogram& IHistogram::observeInteger(uint64_t value)
+    {
+        return observe((double)value);
+    }
+
+    ISummary& ISummary::observeMany(const double* values, size_t count)
+    {
+        for (size_t i = 0; i < count; i++)
+            observe(values[i]);
+        return *this;
+    }
     
     ICounterValue::~ICounterValue() { }
 	IGaugeValue::~IGaugeValue() { }
 	ISummary::~ISummary() { }
 	IHistogram::~IHistogram() { }
+	IExponentialHistogram::~IExponentialHistogram() { }
+
+	CounterValue::~CounterValue() { }
+	GaugeValue::~GaugeValue() { }
+
+	// Counter spreading increments over per-thread slots to avoid cache line contention
+	class ShardedCounterImpl : public ICounterValue
+	{
+	private:
+		ShardedArray<atomic<uint64_t>> m_shards;
+		ModificationStamp m_modified;
+
+	public:
+		ShardedCounterImpl() : m_shards(1) {};
+		ShardedCounterImpl(const ShardedCounterImpl&) = delete;
+		~ShardedCounterImpl() = default;
+		ICounterValue& operator++(int) override
+		{
+			m_shards.local()->fetch_add(1, std::memory_order_relaxed);
+			m_modified.touch();
+			return *this;
+		};
+		ICounterValue& operator+=(uint32_t value) override
+		{
+			m_shards.local()->fetch_add(value, std::memory_order_relaxed);
+			m_modified.touch();
+			return *this;
+		};
+		uint64_t value() const override
+		{
+			uint64_t result = 0;
+			for (size_t i = 0; i < m_shards.shards(); i++)
+				result += m_shards.row(i)->load(std::memory_order_acquire);
+			return result;
+		};
+		void reset() override
+		{
+			for (size_t i = 0; i < m_shards.shards(); i++)
+				m_shards.row(i)->store(0, std::memory_order_release);
+			m_modified.touch();
+		};
+		ModificationStamp* modificationStamp() override { return &m_modified; }
+	};
 
-	class GaugeImpl : public IGaugeValue
+	// Gauge stored as fixed-point integer, so that increments are a single fetch_add
+	class UpDownGaugeImpl : public IGaugeValue
 	{
 	private:
-		atomic<double> m_value;
+		atomic<int64_t> m_value;
+		ModificationStamp m_modified;
 
 	public:
-		GaugeImpl() { m_value.store(0.); };
-		GaugeImpl(GaugeImpl&&) = delete;
-		GaugeImpl(const GaugeImpl&) = delete;
-		~GaugeImpl() = default;
+		UpDownGaugeImpl() : m_value(0) {};
+		UpDownGaugeImpl(const UpDownGaugeImpl&) = delete;
+		~UpDownGaugeImpl() = default;
+
+		// Out of range values saturate and NaN maps to zero, since llround is undefined for them
+		static int64_t toFixed(double value)
+		{
+			const double scaled = value * 1e6;
+			if (!(scaled == scaled))
+				return 0;
+			if (scaled >= 9223372036854774784.)
+				return std::numeric_limits<int64_t>::max();
+			if (scaled <= -9223372036854774784.)
+				return std::numeric_limits<int64_t>::min();
+			return std::llround(scaled);
+		}
+		static double fromFixed(int64_t value) { return value / 1e6; }
 
 		IGaugeValue& operator=(double value) override
 		{
-			m_value.store(value);
+			m_value.store(toFixed(value), std::memory_order_release);
+			m_modified.touch();
 			return *this;
 		};
-
 		IGaugeValue& operator+=(double value) override
 		{
-			// TODO: revisit memory ordering
-			double oldv, newv;
-			do
-			{
-				oldv = m_value.load();
-				newv = oldv + value;
-			} while (!m_value.compare_exchange_weak(oldv, newv));
+			m_value.fetch_add(toFixed(value), std::memory_order_acq_rel);
+			m_modified.touch();
 			return *this;
 		};
-
 		IGaugeValue& operator-=(double value) override
 		{
-			// TODO: revisit memory ordering
-			double oldv, newv;
-			do
-			{
-				oldv = m_value.load();
-				newv = oldv - value;
-			} while (!m_value.compare_exchange_weak(oldv, newv));
+			m_value.fetch_sub(toFixed(value), std::memory_order_acq_rel);
+			m_modified.touch();
 			return *this;
 		};
-
 		double value() const override
 		{
-			return m_value.load();
-		}
+			return fromFixed(m_value.load(std::memory_order_acquire));
+		};
+		ModificationStamp* modificationStamp() override { return &m_modified; }
 	};
 
-	class CounterImpl : public ICounterValue
+	// Fixed-point gauge spreading updates over per-thread slots. Assignment drains every slot and
+	// stores the value into the caller's slot; increments concurrent with it apply before or after
+	// it and are not lost. Assignments are serialized, so that concurrent ones do not add up.
+	// Reads concurrent with assignment may observe partially drained slots
+	class ShardedUpDownGaugeImpl : public IGaugeValue
 	{
 	private:
-		atomic<uint64_t> m_value;
+		ShardedArray<atomic<int64_t>> m_shards;
+		mutex m_assignMutex;
+		ModificationStamp m_modified;
+
+		int64_t total() const
+		{
+			int64_t result = 0;
+			for (size_t i = 0; i < m_shards.shards(); i++)
+				result += m_shards.row(i)->load(std::memory_order_acquire);
+			return result;
+		}
 
 	public:
-        CounterImpl() noexcept { m_value.store(0); };
-        CounterImpl(uint64_t value) noexcept { m_value.store(value); };
-		CounterImpl(CounterImpl&& other) = delete;
-		CounterImpl(const CounterImpl&) = delete;
-		~CounterImpl() = default;
-		ICounterValue& operator++(int) override
+		ShardedUpDownGaugeImpl() : m_shards(1) {};
+		ShardedUpDownGaugeImpl(const ShardedUpDownGaugeImpl&) = delete;
+		~ShardedUpDownGaugeImpl() = default;
+
+		IGaugeValue& operator=(double value) override
 		{
-			m_value.fetch_add(1, std::memory_order_acq_rel);
+			const int64_t fixed = UpDownGaugeImpl::toFixed(value);
+			unique_lock<mutex> lock(m_assignMutex);
+			for (size_t i = 0; i < m_shards.shards(); i++)
+				m_shards.row(i)->exchange(0, std::memory_order_acq_rel);
+			m_shards.local()->fetch_add(fixed, std::memory_order_release);
+			m_modified.touch();
 			return *this;
 		};
-		ICounterValue& operator+=(uint32_t value) override
+		IGaugeValue& operator+=(double value) override
 		{
-			m_value.fetch_add(value, std::memory_order_acq_rel);
+			m_shards.local()->fetch_add(UpDownGaugeImpl::toFixed(value), std::memory_order_relaxed);
+			m_modified.touch();
 			return *this;
 		};
-		uint64_t value() const override
+		IGaugeValue& operator-=(double value) override
 		{
-			return m_value.load(std::memory_order_acquire);
+			m_shards.local()->fetch_sub(UpDownGaugeImpl::toFixed(value), std::memory_order_relaxed);
+			m_modified.touch();
+			return *this;
 		};
-		void reset() override
+		double value() const override
 		{
-			m_value.store(0, std::memory_order_release);
+			return UpDownGaugeImpl::fromFixed(total());
 		};
+		ModificationStamp* modificationStamp() override { return &m_modified; }
 	};
 
+	// Counts a batch of values per bucket into counts and returns their sum
+	static double bucketize(const BucketLayout& layout, const double* values, size_t count, vector<uint64_t>& counts)
+	{
+		counts.assign(layout.size(), 0);
+		double sum = 0;
+		for (size_t i = 0; i < count; i++)
+		{
+			counts[layout.find(values[i])]++;
+			sum += values[i];
+		}
+		return sum;
+	}
+
+	// Adds to a double with a compare-exchange loop
+	static void atomicAdd(atomic<double>& target, double value)
+	{
+		double oldv = target.load(std::memory_order_relaxed);
+		while (!target.compare_exchange_weak(oldv, oldv + value))
+			;
+	}
 
 	class HistogramImpl : public IHistogram {
 	private:
-        const vector<double> m_bounds;
-        vector<CounterImpl> m_counts;
-		GaugeImpl m_sum;
-
-        static vector<double> preprocessBounds(const vector<double>& input) {
-            vector<double> bounds;
-
-            // Reserve extra for +Inf
-            bounds.reserve(bounds.size() + 1); 
-            copy(input.begin(), input.end(), back_inserter(bounds));
-
-            // Add mandatory +Inf bound
-            bounds.push_back(numeric_limits<double>::infinity());
-            sort(bounds.begin(), bounds.end());
-            auto last = unique(bounds.begin(), bounds.end());
-            bounds.erase(last, bounds.end());
-            return bounds;
-        }
+        const shared_ptr<const BucketLayout> m_layout;
+        unique_ptr<atomic<uint64_t>[]> m_counts;
+		atomic<double> m_sum;
+		ModificationStamp m_modified;
+
 	public:
-		HistogramImpl(const vector<double>& bounds) :
-            m_bounds(preprocessBounds(bounds)), m_counts(m_bounds.size()), m_sum()
+		HistogramImpl(shared_ptr<const BucketLayout> layout) :
+            m_layout(layout), m_counts(new atomic<uint64_t>[m_layout->size()]()), m_sum(0.)
 		{
 		}
 
 		HistogramImpl(const HistogramImpl&) = delete;
 
 		IHistogram& observe(double value) override {
-            m_sum += value;
-            auto bound = lower_bound(m_bounds.begin(), m_bounds.end(), value); // Guaranteed to find because of the infinity bound
-            auto index = distance(m_bounds.begin(), bound);
-            m_counts[index]++;
+            atomicAdd(m_sum, value);
+            m_counts[m_layout->find(value)].fetch_add(1, std::memory_order_acq_rel);
+			m_modified.touch();
+			return *this;
+		}
+
+		IHistogram& observeMany(const double* values, size_t count) override {
+			static thread_local vector<uint64_t> counts;
+			atomicAdd(m_sum, bucketize(*m_layout, values, count, counts));
+			for (size_t i = 0; i < counts.size(); i++)
+				if (counts[i] != 0)
+					m_counts[i].fetch_add(counts[i], std::memory_order_acq_rel);
+			m_modified.touch();
 			return *this;
 		}
 
 		vector<pair<double, uint64_t>> values() const override
 		{
 			vector<pair<double, uint64_t>> result;
-            const auto size = m_bounds.size();
+            const auto size = m_layout->size();
 			result.reserve(size);
             uint64_t running_total = 0;
             for (size_t i = 0; i < size; i++)
 			{
-                running_total += m_counts[i].value();
-                result.emplace_back(m_bounds[i], running_total);
+                running_total += m_counts[i].load(std::memory_order_acquire);
+                result.emplace_back((*m_layout)[i], running_total);
 			}
 			return result;
 		};
 
         uint64_t count() const override {
             uint64_t result = 0;
-            for (auto& c : m_counts) {
-                result += c.value();
+            for (size_t i = 0; i < m_layout->size(); i++) {
+                result += m_counts[i].load(std::memory_order_acquire);
             }
             return result;
         };
 
-		double sum() const override { return m_sum; };
+		double sum() const override { return m_sum.load(); };
+		ModificationStamp* modificationStamp() override { return &m_modified; }
+	};
+
+	// Histogram keeping a separate row of bucket counts and sum per thread. The sum is stored
+	// as bits of a double next to the buckets, so an observation touches a single cache line
+	class ShardedHistogramImpl : public IHistogram {
+	private:
+		const shared_ptr<const BucketLayout> m_layout;
+		ShardedArray<atomic<uint64_t>> m_rows;
+		ModificationStamp m_modified;
+
+		static double toDouble(uint64_t bits) { double d; memcpy(&d, &bits, sizeof(d)); return d; }
+		static uint64_t toBits(double d) { uint64_t bits; memcpy(&bits, &d, sizeof(d)); return bits; }
+
+	public:
+		ShardedHistogramImpl(shared_ptr<const BucketLayout> layout) :
+			m_layout(layout), m_rows(m_layout->size() + 1)
+		{
+		}
+
+		ShardedHistogramImpl(const ShardedHistogramImpl&) = delete;
+
+		IHistogram& observe(double value) override {
+			auto row = m_rows.local();
+			row[m_layout->find(value)].fetch_add(1, std::memory_order_relaxed);
+
+			// Only threads sharing the row contend here
+			auto& sum = row[m_layout->size()];
+			uint64_t oldv = sum.load(std::memory_order_relaxed);
+			while (!sum.compare_exchange_weak(oldv, toBits(toDouble(oldv) + value), std::memory_order_relaxed))
+				;
+			m_modified.touch();
+			return *this;
+		}
+
+		IHistogram& observeMany(const double* values, size_t count) override {
+			static thread_local vector<uint64_t> counts;
+			const double total = bucketize(*m_layout, values, count, counts);
+
+			auto row = m_rows.local();
+			for (size_t i = 0; i < counts.size(); i++)
+				if (counts[i] != 0)
+					row[i].fetch_add(counts[i], std::memory_order_relaxed);
+
+			auto& sum = row[m_layout->size()];
+			uint64_t oldv = sum.load(std::memory_order_relaxed);
+			while (!sum.compare_exchange_weak(oldv, toBits(toDouble(oldv) + total), std::memory_order_relaxed))
+				;
+			m_modified.touch();
+			return *this;
+		}
+
+		vector<pair<double, uint64_t>> values() const override
+		{
+			vector<pair<double, uint64_t>> result;
+			const auto size = m_layout->size();
+			result.reserve(size);
+			uint64_t running_total = 0;
+			for (size_t i = 0; i < size; i++)
+			{
+				for (size_t shard = 0; shard < m_rows.shards(); shard++)
+					running_total += m_rows.row(shard)[i].load(std::memory_order_acquire);
+				result.emplace_back((*m_layout)[i], running_total);
+			}
+			return result;
+		};
+
+		uint64_t count() const override {
+			uint64_t result = 0;
+			for (size_t shard = 0; shard < m_rows.shards(); shard++)
+				for (size_t i = 0; i < m_layout->size(); i++)
+					result += m_rows.row(shard)[i].load(std::memory_order_acquire);
+			return result;
+		};
+
+		double sum() const override {
+			double result = 0;
+			for (size_t shard = 0; shard < m_rows.shards(); shard++)
+				result += toDouble(m_rows.row(shard)[m_layout->size()].load(std::memory_order_acquire));
+			return result;
+		};
+
+		ModificationStamp* modificationStamp() override { return &m_modified; }
+	};
+
+	// Histogram over integer observations, e.g. nanoseconds. Bucket search uses integer compares and
+	// the sum is a plain integer counter, so observe() never loops on a compare-exchange.
+	// Bounds and sum are multiplied by unit when read, so that values can be exposed in seconds
+	class IntegerHistogramImpl : public IHistogram {
+	private:
+		const vector<uint64_t> m_bounds;
+		const double m_unit;
+		unique_ptr<atomic<uint64_t>[]> m_counts;
+		atomic<uint64_t> m_sum;
+		ModificationStamp m_modified;
+
+		static uint64_t toInteger(double value)
+		{
+			return !(value > 0) ? 0 : value >= 18446744073709551616. ? UINT64_MAX : (uint64_t)(value + .5);
+		}
+
+		size_t find(uint64_t value) const
+		{
+			return std::lower_bound(m_bounds.begin(), m_bounds.end(), value) - m_bounds.begin();
+		}
+
+	public:
+		IntegerHistogramImpl(const vector<uint64_t>& bounds, double unit) :
+			m_bounds(bounds), m_unit(unit), m_counts(new atomic<uint64_t>[bounds.size() + 1]()), m_sum(0)
+		{
+		}
+
+		IntegerHistogramImpl(const IntegerHistogramImpl&) = delete;
+
+		IHistogram& observe(double value) override {
+			return observeInteger(toInteger(value));
+		}
+
+		IHistogram& observeInteger(uint64_t value) override {
+			m_sum.fetch_add(value, std::memory_order_relaxed);
+			m_counts[find(value)].fetch_add(1, std::memory_order_acq_rel);
+			m_modified.touch();
+			return *this;
+		}
+
+		IHistogram& observeMany(const double* values, size_t count) override {
+			static thread_local vector<uint64_t> counts;
+			counts.assign(m_bounds.size() + 1, 0);
+			uint64_t sum = 0;
+			for (size_t i = 0; i < count; i++)
+			{
+				const uint64_t v = toInteger(values[i]);
+				counts[find(v)]++;
+				sum += v;
+			}
+
+			m_sum.fetch_add(sum, std::memory_order_relaxed);
+			for (size_t i = 0; i < counts.size(); i++)
+				if (counts[i] != 0)
+					m_counts[i].fetch_add(counts[i], std::memory_order_acq_rel);
+			m_modified.touch();
+			return *this;
+		}
+
+		vector<pair<double, uint64_t>> values() const override
+		{
+			vector<pair<double, uint64_t>> result;
+			result.reserve(m_bounds.size() + 1);
+			uint64_t running_total = 0;
+			for (size_t i = 0; i < m_bounds.size(); i++)
+			{
+				running_total += m_counts[i].load(std::memory_order_acquire);
+				result.emplace_back(m_bounds[i] * m_unit, running_total);
+			}
+			running_total += m_counts[m_bounds.size()].load(std::memory_order_acquire);
+			result.emplace_back(std::numeric_limits<double>::infinity(), running_total);
+			return result;
+		};
+
+		uint64_t count() const override {
+			uint64_t result = 0;
+			for (size_t i = 0; i <= m_bounds.size(); i++)
+				result += m_counts[i].load(std::memory_order_acquire);
+			return result;
+		};
+
+		double sum() const override { return m_sum.load(std::memory_order_acquire) * m_unit; };
+		ModificationStamp* modificationStamp() override { return &m_modified; }
 	};
 
 	// Definitions for functions referenced in registry.cpp
-	std::shared_ptr<ICounterValue> makeCounter() { return std::make_shared<CounterImpl>(); };
-	std::shared_ptr<IGaugeValue> makeGauge() { return std::make_shared<GaugeImpl>(); };
-	std::shared_ptr<IHistogram> makeHistogram(const vector<double>& bounds) { return std::make_shared<HistogramImpl>(bounds); };
+	std::shared_ptr<ICounterValue> makeCounter(Sharding sharding)
+	{
+		if (sharding == Sharding::PerThread)
+			return std::make_shared<ShardedCounterImpl>();
+		return std::make_shared<CounterValue>();
+	};
+	std::shared_ptr<IGaugeValue> makeGauge(GaugeKind kind, Sharding sharding)
+	{
+		if (kind == GaugeKind::UpDown)
+		{
+			if (sharding == Sharding::PerThread)
+				return std::make_shared<ShardedUpDownGaugeImpl>();
+			return std::make_shared<UpDownGaugeImpl>();
+		}
+		return std::make_shared<GaugeValue>();
+	};
+	std::shared_ptr<IHistogram> makeHistogram(std::shared_ptr<const IHistogramBuckets> buckets, Sharding sharding)
+	{
+		auto layout = std::dynamic_pointer_cast<const BucketLayout>(buckets);
+		if (!layout) // Implemented outside of library - copy its bounds
+			layout = std::static_pointer_cast<const BucketLayout>(makeBuckets(buckets->bounds()));
+
+		if (sharding == Sharding::PerThread)
+			return std::make_shared<ShardedHistogramImpl>(layout);
+		return std::make_shared<HistogramImpl>(layout);
+	};
+	std::shared_ptr<IHistogram> makeHistogram(const vector<double>& bounds, Sharding sharding) { return makeHistogram(makeBuckets(bounds), sharding); };
+	std::shared_ptr<IHistogram> makeIntegerHistogram(const vector<uint64_t>& bounds, double unit)
+	{
+		if (!(unit > 0) || std::isinf(unit))
+			throw std::logic_error("Integer histogram unit must be positive");
+		auto b = bounds;
+		std::sort(b.begin(), b.end());
+		b.erase(std::unique(b.begin(), b.end()), b.end());
+		return std::make_shared<IntegerHistogramImpl>(b, unit);
+	};
 }
@@ -1,84 +1,455 @@
 #include <metrics/registry.h>
 #include <metrics/metric.h>
 
+#include "common/concurrent_index.h"
+#include "common/family.h"
+#include "common/label_set.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <map>
 #include <mutex>
 #include <cstdint>
+#include <cstring>
 #include <stdexcept>
+#include <tuple>
 #include <functional>
-#include <unordered_map>
 
 using namespace std;
 
 
 namespace Metrics {
-    struct MetricKeyHasher
+    // Hash of metric name and labels. Label hashes are summed, so that lookups with views
+    // given in arbitrary order produce same hash as sorted Labels
+    template<typename TIterator> uint64_t hashKey(uint64_t nameHash, TIterator begin, TIterator end)
+    {
+        uint64_t labels = 0;
+        for (auto it = begin; it != end; it++)
+            labels += KeyHash().add(it->first).add(it->second).value();
+        return KeyHash(nameHash).add(labels).value();
+    }
+
+    inline uint64_t hashKey(uint64_t nameHash, const LabelSet& labels)
+    {
+        uint64_t sum = 0;
+        for (const LabelRef& label : labels)
+            sum += KeyHash().add(*label.name).add(*label.value).value();
+        return KeyHash(nameHash).add(sum).value();
+    }
+
+    // Value which changes whenever the metric is updated, used to detect idle and changed series of metrics
+    // which do not track modification generation
+    static uint64_t fingerprint(IMetric& metric)
     {
-        // Hash
-        uint64_t operator()(const std::string& name, const Labels& labels) const
+        switch (metric.type()) {
+        case TypeCode::Counter:
+            return static_cast<ICounterValue&>(metric).value();
+        case TypeCode::Gauge: {
+            const double value = static_cast<IGaugeValue&>(metric).value();
+            uint64_t bits;
+            memcpy(&bits, &value, sizeof(bits));
+            return bits;
+        }
+        case TypeCode::Histogram:
+            return static_cast<IHistogram&>(metric).count();
+        case TypeCode::Summary:
+            return static_cast<ISummary&>(metric).count();
+        case TypeCode::ExponentialHistogram:
+            return static_cast<IExponentialHistogram&>(metric).count();
+        }
+        return 0;
+    }
+
+    struct Series {
+        const shared_ptr<IMetric> metric;
+        ModificationStamp* const stamp; // nullptr if metric does not track modifications
+
+        // Guarded by group lock: value fingerprint when last observed (metrics without modification stamp only),
+        // collection generation in which a change was last observed (0 until first observation) and time of
+        // that observation or creation
+        uint64_t fingerprint;
+        uint64_t generation;
+        chrono::steady_clock::time_point changed;
+        size_t tracked; // position in list of tracked series of the group
+
+        // Referenced by CounterRef/GaugeRef or added explicitly: never expired. Series referenced by handles are not removed
+        mutable atomic<bool> pinned;
+
+        Series(shared_ptr<IMetric> metric, bool pinned) :
+            metric(move(metric)),
+            stamp(this->metric->modificationStamp()),
+            fingerprint(stamp ? 0 : Metrics::fingerprint(*this->metric)),
+            generation(0),
+            changed(chrono::steady_clock::now()),
+            tracked(0),
+            pinned(pinned)
         {
-            hash<string> h;
-            // computes the hash of an employee using a variant
-            // of the Fowler-Noll-Vo hash function
-            constexpr uint64_t prime{ 0x100000001B3 };
-            uint64_t result = h(name);
-            for (auto it = labels.cbegin(); it != labels.cend(); it++)
-                result = (result * prime) ^ h(it->first) ^ h(it->second);
+        }
 
-            return result;
+        // Records a change since group was last observed in generation previous. Returns false if unchanged.
+        // Metric with modification stamp changed if modified in or after previous: an update which the values
+        // read then missed was stamped with a generation not older than it
+        bool observe(uint64_t collection, uint64_t previous, chrono::steady_clock::time_point now)
+        {
+            if (stamp) {
+                if (generation != 0 && stamp->value() < previous)
+                    return false;
+            }
+            else {
+                const uint64_t current = Metrics::fingerprint(*metric);
+                if (current == fingerprint && generation != 0)
+                    return false;
+                fingerprint = current;
+            }
+            generation = collection;
+            changed = now;
+            return true;
         }
     };
 
+    typedef pair<const LabelSet, Series> SeriesEntry;
+
+    struct RemovedSeries {
+        Labels labels;
+        shared_ptr<IMetric> metric;
+    };
+
+    // Lookup path for existing series, keyed by hash of name and labels. Entries point into
+    // group maps; groups are never removed and erase series only after unlinking them here
+    struct IndexEntry {
+        const string* name;
+        const SeriesEntry* series;
+    };
+
+    typedef ConcurrentIndex<IndexEntry> SeriesIndex;
+
+    // Series caps of a registry, shared by its groups. Caps apply to series created by lookups; series are
+    // counted only if registry has a cap
+    struct SeriesBudget {
+        const size_t maxSeries;
+        const size_t maxSeriesPerGroup;
+        atomic<size_t> size;
+
+        // Lookups redirected to overflow series. Its series is not counted, so that caps apply to user series only
+        Counter rejected;
+
+        SeriesBudget(const RegistryOptions& options) :
+            maxSeries(options.maxSeries),
+            maxSeriesPerGroup(options.maxSeriesPerGroup),
+            size(0)
+        {
+        }
+
+        bool limited() const { return maxSeries != 0 || maxSeriesPerGroup != 0; }
+
+        // Reserves a series in a group of given size, unless a cap is reached
+        bool acquire(size_t groupSize)
+        {
+            if (maxSeriesPerGroup != 0 && groupSize >= maxSeriesPerGroup)
+                return false;
+            size_t current = size.load(memory_order_relaxed);
+            do {
+                if (maxSeries != 0 && current >= maxSeries)
+                    return false;
+            } while (!size.compare_exchange_weak(current, current + 1, memory_order_relaxed));
+            return true;
+        }
+
+        void added() { if (limited()) size.fetch_add(1, memory_order_relaxed); }
+        void removed(size_t count) { if (limited()) size.fetch_sub(count, memory_order_relaxed); }
+    };
+
     class MetricGroup : public IMetricGroup {
     private:
         mutable mutex m_mutex;
         TypeCode m_type;
-        string m_description;
-        map<Labels, shared_ptr<IMetric>> m_metrics;
+        const string* m_description; // interned, so that snapshots may refer to it
+        SymbolTable& m_symbols;
+        SeriesBudget& m_budget;
+        map<LabelSet, Series> m_metrics;
+
+        // Series with their modification stamps, so that finding changed series reads one stamp of each unchanged
+        // series with a stamp instead of visiting the map. Series are touched when added, so that next collection
+        // observes them
+        struct Tracked {
+            ModificationStamp* stamp;
+            map<LabelSet, Series>::iterator series;
+        };
+        vector<Tracked> m_tracked;
+        vector<map<LabelSet, Series>::iterator> m_changed; // reused buffer
+
+        // Collection generations in which series were last observed, most recent first, 0 if none
+        uint64_t m_observed[4];
+
+        // Starts observation of series in given generation. Returns generation of previous observation
+        uint64_t observeLocked(uint64_t generation)
+        {
+            const uint64_t previous = m_observed[0];
+            copy_backward(m_observed, m_observed + 3, m_observed + 4);
+            m_observed[0] = generation;
+            return previous;
+        }
+
+        // Latest observation not after given generation, 0 if not known. Series observed as changed after given
+        // generation are stamped no earlier than it, since they were modified or added after it
+        uint64_t observedAt(uint64_t generation) const
+        {
+            for (uint64_t observed : m_observed)
+                if (observed <= generation)
+                    return observed;
+            return 0;
+        }
+
+        // Series which receives updates of label sets rejected by series caps
+        shared_ptr<IMetric> m_overflow;
+
+        // Histogram buckets last used in this group. Series with same bounds share one instance
+        shared_ptr<const IHistogramBuckets> m_buckets;
+
+        // Series referenced only by the group, i.e. not held by callers, families caching strong
+        // references, local buffers or snapshots
+        static bool unreferenced(const Series& series)
+        {
+            return !series.pinned.load() && series.metric.use_count() == 1;
+        }
+
+        // Unlinks series from index, waits for readers which may have found them and erases them, releasing their labels.
+        // Series pinned meanwhile through the index, or referenced if onlyUnreferenced is set, are kept in the group;
+        // lookups index them again. Must be called under m_mutex
+        vector<RemovedSeries> eraseLocked(const vector<decltype(m_metrics)::iterator>& victims, SeriesIndex& index, uint64_t nameHash, bool onlyUnreferenced = false)
+        {
+            vector<RemovedSeries> result;
+            if (victims.empty())
+                return result;
+            for (auto it : victims) {
+                const SeriesEntry* series = &*it;
+                index.remove(hashKey(nameHash, it->first), [&](const IndexEntry& entry) { return entry.series == series; });
+            }
+            index.reclaim();
+            for (auto it : victims) {
+                if (it->second.pinned.load() || (onlyUnreferenced && !unreferenced(it->second)))
+                    continue;
+                result.push_back(RemovedSeries{ it->first.labels(), it->second.metric });
+                if (it->second.metric == m_overflow)
+                    m_overflow.reset();
+                else
+                    m_budget.removed(1);
+                it->first.release(m_symbols);
+                untrackLocked(it->second);
+                m_metrics.erase(it);
+            }
+            return result;
+        }
+
+        // Makes room for a series in list of tracked series, so that tracking it does not throw. Must be called under m_mutex
+        void reserveTrackedLocked()
+        {
+            if (m_tracked.size() == m_tracked.capacity())
+                m_tracked.reserve(2 * m_tracked.size() + 1);
+        }
+
+        // Must be called under m_mutex, after reserveTrackedLocked
+        void trackLocked(map<LabelSet, Series>::iterator it)
+        {
+            it->second.tracked = m_tracked.size();
+            m_tracked.push_back(Tracked{ it->second.stamp, it });
+            if (it->second.stamp)
+                it->second.stamp->touch();
+        }
+
+        void untrackLocked(Series& series)
+        {
+            m_tracked[series.tracked] = m_tracked.back();
+            m_tracked[series.tracked].series->second.tracked = series.tracked;
+            m_tracked.pop_back();
+        }
+
+        // Overflow series is not counted towards series caps, so that a group may hold one in addition
+        template<typename TFactory> const SeriesEntry& overflowLocked(TFactory& factory)
+        {
+            static const Labels s_labels = { { "overflow", "true" } };
+            LabelSet key(s_labels, m_symbols);
+            auto it = m_metrics.find(key);
+            if (it == m_metrics.end()) {
+                it = emplaceLocked(move(key), factory, false);
+            }
+            else {
+                key.release(m_symbols);
+                if (it->second.metric != m_overflow)
+                    m_budget.removed(1); // created with these labels explicitly, stops counting towards caps
+            }
+            m_overflow = it->second.metric;
+            return *it;
+        }
+
+        // Adds series created by factory. Labels of key, and series cap slot if one was acquired for it, are released if factory throws
+        template<typename TFactory> map<LabelSet, Series>::iterator emplaceLocked(LabelSet&& key, TFactory& factory, bool counted)
+        {
+            shared_ptr<IMetric> metric;
+            try {
+                reserveTrackedLocked();
+                metric = factory();
+            }
+            catch (...) {
+                key.release(m_symbols);
+                if (counted)
+                    m_budget.removed(1);
+                throw;
+            }
+            auto it = m_metrics.emplace(piecewise_construct, forward_as_tuple(move(key)), forward_as_tuple(move(metric), false)).first;
+            trackLocked(it);
+            return it;
+        }
 
     public:
-        MetricGroup(TypeCode type) : m_type(type) { }
+        MetricGroup(TypeCode type, SymbolTable& symbols, SeriesBudget& budget) : m_type(type), m_description(nullptr), m_symbols(symbols), m_budget(budget), m_observed() { }
         ~MetricGroup() = default;
         MetricGroup(const MetricGroup&) = delete;
         MetricGroup(MetricGroup&&) = delete;
 
-        typedef decltype(m_metrics)::const_iterator const_iterator;
-
         TypeCode type() const override { return m_type; }
 
         string description() const override {
             unique_lock<mutex> lock(m_mutex);
-            return m_description;
+            return m_description ? *m_description : string();
         }
 
         void setDescription(const string& description) {
+            const string* interned = m_symbols.intern(description);
+            unique_lock<mutex> lock(m_mutex);
+            if (m_description)
+                m_symbols.release(m_description);
+            m_description = interned;
+        }
+
+        // Adds series changed after collection generation since, attributing changes to generation.
+        // Groups without such series are omitted, unless all series are collected
+        void snapshot(const string& name, RegistrySnapshot& snapshot, uint64_t since, uint64_t generation, chrono::steady_clock::time_point now)
+        {
             unique_lock<mutex> lock(m_mutex);
-            m_description = description;
+            const string* description = m_description && !m_description->empty() ? m_description : nullptr;
+            const uint64_t previous = observeLocked(generation);
+            if (since == 0) {
+                snapshot.addGroup(&name, description, m_type);
+                for (auto& kv : m_metrics) {
+                    kv.second.observe(generation, previous, now);
+                    snapshot.addSeries(kv.first.begin(), kv.first.end(), kv.second.metric);
+                }
+                return;
+            }
+
+            // Series stamped before observation at or before since are unchanged since then, so they are skipped without being visited
+            const uint64_t unchanged = observedAt(since);
+            m_changed.clear();
+            for (const Tracked& tracked : m_tracked) {
+                if (tracked.stamp && tracked.stamp->value() < unchanged)
+                    continue;
+                Series& series = tracked.series->second;
+                series.observe(generation, previous, now);
+                if (series.generation > since)
+                    m_changed.push_back(tracked.series);
+            }
+            if (m_changed.empty())
+                return;
+            sort(m_changed.begin(), m_changed.end(), [](map<LabelSet, Series>::iterator l, map<LabelSet, Series>::iterator r) { return l->first < r->first; });
+            snapshot.addGroup(&name, description, m_type);
+            for (auto it : m_changed)
+                snapshot.addSeries(it->first.begin(), it->first.end(), it->second.metric);
         }
 
-        bool add(const Labels& labels, shared_ptr<IMetric> metric)
+        // Series added uncounted are not charged to series caps
+        bool add(const Labels& labels, shared_ptr<IMetric> metric, bool counted = true)
         {
             unique_lock<mutex> lock(m_mutex);
 
             if (m_type != metric->type())
                 throw logic_error("Inconsistent type of metric");
 
-            return m_metrics.emplace(labels, metric).second;
+            LabelSet key(labels, m_symbols);
+            if (m_metrics.find(key) != m_metrics.end()) {
+                key.release(m_symbols);
+                return false;
+            }
+            try {
+                reserveTrackedLocked();
+            }
+            catch (...) {
+                key.release(m_symbols);
+                throw;
+            }
+            trackLocked(m_metrics.emplace(piecewise_construct, forward_as_tuple(move(key)), forward_as_tuple(metric, true)).first);
+            if (counted)
+                m_budget.added();
+            return true;
         }
 
-        template<typename TValueProxy> TValueProxy get(const Labels& labels, function<shared_ptr<typename TValueProxy::value_type>(void)> factory)
+        // Returns shared buckets instance equal to provided bounds. Must be called under group lock, e.g. from factory
+        shared_ptr<const IHistogramBuckets> buckets(const vector<double>& bounds)
         {
+            // Stored bounds are sorted, unique and end with +Inf; bounds equal to them with or without
+            // the +Inf produce the same layout, so it is reused without building a new one
+            if (m_buckets) {
+                const vector<double>& stored = m_buckets->bounds();
+                const size_t size = bounds.size() == stored.size() ? stored.size() : stored.size() - 1;
+                if (size == bounds.size() && equal(bounds.begin(), bounds.end(), stored.begin()))
+                    return m_buckets;
+            }
+            m_buckets = makeBuckets(bounds);
+            return m_buckets;
+        }
+
+        // Finds series with given labels, creating it if missing, and passes it to publish under group lock,
+        // so that it is not removed before publish has added it to the index. If a series cap is reached,
+        // overflow series is passed instead, with overflow flag set
+        template<typename TFactory, typename TPublish> auto get(const Labels& labels, TFactory factory, TPublish publish) -> decltype(publish(declval<const SeriesEntry&>(), false))
+        {
+            // Labels of a key which is not added are released, so that e.g. values rejected by caps do not accumulate in symbol table
+            LabelSet key(labels, m_symbols);
             unique_lock<mutex> lock(m_mutex);
-            auto it = m_metrics.find(labels);
-            if (it == m_metrics.end()) {
-                auto new_value = factory();
-                it = m_metrics.emplace(move(Labels(labels)), move(new_value)).first;
+            auto it = m_metrics.find(key);
+            if (it != m_metrics.end()) {
+                key.release(m_symbols);
+                return publish(*it, false);
             }
-            auto metric = it->second;
-            if (TValueProxy::value_type::stype() != it->second->type()) {
-                throw logic_error("Inconsistent type of metric");
+            if (m_budget.limited() && !m_budget.acquire(m_metrics.size() - (m_overflow ? 1 : 0))) {
+                key.release(m_symbols);
+                m_budget.rejected++;
+                return publish(overflowLocked(factory), true);
             }
-            return TValueProxy(static_pointer_cast<typename TValueProxy::value_type>(metric));
+            return publish(*emplaceLocked(move(key), factory, m_budget.limited()), false);
+        }
+
+        bool isOverflow(const IMetric& metric) const
+        {
+            unique_lock<mutex> lock(m_mutex);
+            return m_overflow.get() == &metric;
+        }
+
+        vector<RemovedSeries> remove(const Labels& labels, SeriesIndex& index, uint64_t nameHash)
+        {
+            LabelSet key(labels, m_symbols);
+            unique_lock<mutex> lock(m_mutex);
+            auto it = m_metrics.find(key);
+            key.release(m_symbols);
+            if (it == m_metrics.end() || it->second.pinned.load())
+                return vector<RemovedSeries>();
+            return eraseLocked({ it }, index, nameHash);
+        }
+
+        // Removes series which have not changed for given time and are not referenced outside the registry.
+        // Changes are attributed to given collection generation
+        vector<RemovedSeries> expire(chrono::steady_clock::duration after, uint64_t generation, chrono::steady_clock::time_point now, SeriesIndex& index, uint64_t nameHash)
+        {
+            unique_lock<mutex> lock(m_mutex);
+            vector<decltype(m_metrics)::iterator> victims;
+            const uint64_t previous = observeLocked(generation);
+            for (const Tracked& tracked : m_tracked) {
+                Series& series = tracked.series->second;
+                if (!series.observe(generation, previous, now) && unreferenced(series) && now - series.changed >= after)
+                    victims.push_back(tracked.series);
+            }
+            return eraseLocked(victims, index, nameHash, true);
         }
 
         vector<pair<Labels, shared_ptr<IMetric>>> metrics() const override
@@ -88,7 +459,7 @@ namespace Metrics {
             result.reserve(m_metrics.size());
 
             for (const auto& kv : m_metrics)
-                result.emplace_back(kv.first, kv.second);
+                result.emplace_back(kv.first.labels(), kv.second.metric);
 
             return result;
         }
@@ -99,93 +470,373 @@ namespace Metrics {
         }
     };
 
+    atomic<uint64_t> ModificationStamp::s_current(0);
+
+    uint64_t nextCollectionGeneration()
+    {
+        return ++ModificationStamp::s_current;
+    }
+
     class RegistryImpl : public IRegistry
     {
     private:
-        mutable mutex m_mutex;
+        // Label names and values of all series, and series caps; declared before groups, which refer to them
+        SymbolTable m_symbols;
+        SeriesBudget m_budget;
+
+        // Groups are partitioned by name hash, so that series of different names are created under different locks
+        struct Shard {
+            mutable std::mutex mutex;
+
+            // Group metrics by name to support Prometheus model
+            map<string, MetricGroup> groups;
+
+            SeriesIndex index;
+        };
+
+        const size_t m_shardCount;
+        unique_ptr<Shard[]> m_shards;
+        const chrono::steady_clock::duration m_expireAfter;
 
-        // Group metrics by name to support Prometheus model
-        map<string, MetricGroup> m_groups;
+        // Serializes collections, which observe series changes
+        mutex m_collectionMutex;
+
+        // Families are told about removed series, so that they do not return them anymore
+        mutex m_familiesMutex;
+        multimap<string, weak_ptr<IFamily>> m_families;
+
+        Shard& shard(uint64_t nameHash) const { return m_shards[nameHash % m_shardCount]; }
+        Shard& shard(const string& name) const { return shard(KeyHash().add(name).value()); }
+
+        template<typename TValueProxy, typename TFactory> TValueProxy get(const string& name, const Labels& labels, TFactory factory, bool pin = false)
+        {
+            typedef typename TValueProxy::value_type value_type;
+
+            const uint64_t nameHash = KeyHash().add(name).value();
+            const uint64_t hash = hashKey(nameHash, labels.cbegin(), labels.cend());
+            auto matches = [&](const IndexEntry& entry) { return *entry.name == name && entry.series->first == labels; };
+            Shard& s = shard(nameHash);
+            {
+                EpochGuard guard;
+                if (const IndexEntry* entry = s.index.find(hash, matches))
+                    return cast<TValueProxy>(entry->series->second, pin);
+            }
+
+            auto& group = getOrCreateGroup(s, name, value_type::stype());
+            return group.second.get(labels, [&]() { return factory(group.second); }, [&](const SeriesEntry& series, bool overflow) {
+                // Overflow series is shared by any number of label sets, so these are not indexed
+                if (!overflow) {
+                    IndexEntry created = { &group.first, &series };
+                    s.index.insert(hash, created, matches);
+                }
+                return cast<TValueProxy>(series.second, pin);
+            });
+        }
+
+        // Lookup by views allocates only when series has to be created
+        template<typename TValueProxy, typename TFactory> TValueProxy get(StringView name, const LabelView* labels, size_t count, TFactory factory)
+        {
+            const uint64_t nameHash = KeyHash().add(name).value();
+            const uint64_t hash = hashKey(nameHash, labels, labels + count);
+            auto matches = [&](const IndexEntry& entry) {
+                const LabelSet& stored = entry.series->first;
+                if (name != *entry.name || stored.size() != count)
+                    return false;
+                // Counts are equal, so every stored label found among views means views have no other labels
+                for (const LabelRef& label : stored) {
+                    auto view = find_if(labels, labels + count, [&](const LabelView& l) { return l.first == *label.name; });
+                    if (view == labels + count || view->second != *label.value)
+                        return false;
+                }
+                return true;
+            };
+            {
+                EpochGuard guard;
+                if (const IndexEntry* entry = shard(nameHash).index.find(hash, matches))
+                    return cast<TValueProxy>(entry->series->second, false);
+            }
+
+            Labels owned;
+            for (size_t i = 0; i < count; i++)
+                owned[labels[i].first.str()] = labels[i].second.str();
+            return get<TValueProxy>(name.str(), owned, factory);
+        }
+
+        template<typename TValueProxy> static TValueProxy cast(const Series& series, bool pin)
+        {
+            typedef typename TValueProxy::value_type value_type;
+            if (value_type::stype() != series.metric->type())
+                throw logic_error("Inconsistent type of metric");
+            if (pin && !series.pinned.load(memory_order_relaxed))
+                series.pinned.store(true);
+            return TValueProxy(static_pointer_cast<value_type>(series.metric));
+        }
+
+        // Removes series from families of the group
+        void release(const string& name, const vector<RemovedSeries>& removed)
+        {
+            if (removed.empty())
+                return;
+
+            vector<shared_ptr<IFamily>> families;
+            {
+                unique_lock<mutex> lock(m_familiesMutex);
+                auto range = m_families.equal_range(name);
+                for (auto it = range.first; it != range.second;) {
+                    if (auto family = it->second.lock()) {
+                        families.push_back(family);
+                        it++;
+                    }
+                    else {
+                        it = m_families.erase(it);
+                    }
+                }
+            }
+            for (const auto& family : families)
+                for (const auto& series : removed)
+                    family->remove(series.labels);
+        }
 
     public:
-        RegistryImpl() = default;
+        RegistryImpl(const RegistryOptions& options) :
+            m_symbols(options.shards),
+            m_budget(options),
+            m_shardCount(options.shards),
+            m_shards(new Shard[options.shards]),
+            m_expireAfter(options.expireAfter)
+        {
+            if (m_budget.limited()) {
+                const string name = "metrics_rejected_series_total";
+                getOrCreateGroup(shard(name), name, TypeCode::Counter).second.add({}, m_budget.rejected.raw(), false);
+                setDescription(name, "Lookups of new series redirected to overflow series by series caps");
+            }
+        }
+
         ~RegistryImpl() {}
 
         const IMetricGroup& getGroup(const string& name) const override
         {
-            unique_lock<mutex> lock(m_mutex);
-            auto it = m_groups.find(name);
-            if (it == m_groups.end())
+            Shard& s = shard(name);
+            unique_lock<mutex> lock(s.mutex);
+            auto it = s.groups.find(name);
+            if (it == s.groups.end())
                 throw std::logic_error("Group not found");
             return it->second;
         }
 
-        MetricGroup& getOrCreateGroup(const string& name, TypeCode type)
+        map<string, MetricGroup>::value_type& getOrCreateGroup(Shard& s, const string& name, TypeCode type)
         {
-            unique_lock<mutex> lock(m_mutex);
-            auto it = m_groups.find(name);
+            unique_lock<mutex> lock(s.mutex);
+            auto it = s.groups.find(name);
 
-            if (it == m_groups.end()) {
-                it = m_groups.emplace(name, type).first;
+            if (it == s.groups.end()) {
+                it = s.groups.emplace(piecewise_construct, forward_as_tuple(name), forward_as_tuple(type, ref(m_symbols), ref(m_budget))).first;
             }
             else if (type != it->second.type()) {
                 throw logic_error("Inconsistent type of metric");
             }
 
-            return it->second;
+            return *it;
         }
 
-        Gauge getGauge(const std::string& name, const Labels& labels) override {
-            auto& group = getOrCreateGroup(name, TypeCode::Gauge);
-            return group.get<Gauge>(labels, makeGauge);
+        Gauge getGauge(const std::string& name, const Labels& labels, GaugeKind kind, Sharding sharding) override {
+            return get<Gauge>(name, labels, [&](MetricGroup&) { return makeGauge(kind, sharding); });
+        };
+
+        Gauge getGauge(StringView name, const LabelView* labels, size_t count, GaugeKind kind, Sharding sharding) override {
+            return get<Gauge>(name, labels, count, [&](MetricGroup&) { return makeGauge(kind, sharding); });
         };
 
-        Counter getCounter(const std::string& name, const Labels& labels) override {
-            auto& group = getOrCreateGroup(name, TypeCode::Counter);
-            return group.get<Counter>(labels, makeCounter);
+        Counter getCounter(const std::string& name, const Labels& labels, Sharding sharding) override {
+            return get<Counter>(name, labels, [&](MetricGroup&) { return makeCounter(sharding); });
         };
 
+        Counter getCounter(StringView name, const LabelView* labels, size_t count, Sharding sharding) override {
+            return get<Counter>(name, labels, count, [&](MetricGroup&) { return makeCounter(sharding); });
+        };
+
+        // Referenced series are pinned, so references stay valid while registry is alive
+        CounterRef getCounterRef(const std::string& name, const Labels& labels, Sharding sharding) override {
+            auto counter = get<Counter>(name, labels, [&](MetricGroup&) { return makeCounter(sharding); }, true);
+            return CounterRef(*static_pointer_cast<ICounterValue>(counter.raw()));
+        }
+
+        GaugeRef getGaugeRef(const std::string& name, const Labels& labels, GaugeKind kind, Sharding sharding) override {
+            auto gauge = get<Gauge>(name, labels, [&](MetricGroup&) { return makeGauge(kind, sharding); }, true);
+            return GaugeRef(*static_pointer_cast<IGaugeValue>(gauge.raw()));
+        }
+
         Summary getSummary(const std::string& name, const Labels& labels, const vector<double>& quantiles, double error) override {
-            auto& group = getOrCreateGroup(name, TypeCode::Summary);
-            return group.get<Summary>(labels, bind(makeSummary, quantiles, error));
+            return get<Summary>(name, labels, [&](MetricGroup&) { return makeSummary(quantiles, error); });
+        }
+
+        Summary getSummary(const std::string& name, const Labels& labels, const vector<double>& quantiles, double error, std::chrono::steady_clock::duration maxAge, size_t ageBuckets) override {
+            return get<Summary>(name, labels, [&](MetricGroup&) { return makeSummary(quantiles, error, maxAge, ageBuckets); });
+        }
+
+        Summary getHdrSummary(const std::string& name, const Labels& labels, const vector<double>& quantiles, uint64_t highest, int significantDigits) override {
+            return get<Summary>(name, labels, [&](MetricGroup&) { return makeHdrSummary(quantiles, highest, significantDigits); });
+        }
+
+        Histogram getHistogram(const std::string& name, const Labels& labels, const vector<double>& bounds, Sharding sharding) override {
+            return get<Histogram>(name, labels, [&](MetricGroup& group) { return makeHistogram(group.buckets(bounds), sharding); });
         }
 
-        Histogram getHistogram(const std::string& name, const Labels& labels, const vector<double>& bounds) override {
-            auto& group = getOrCreateGroup(name, TypeCode::Histogram);
-            return group.get<Histogram>(labels, bind(makeHistogram, bounds));
+        Histogram getHistogram(StringView name, const LabelView* labels, size_t count, const vector<double>& bounds, Sharding sharding) override {
+            return get<Histogram>(name, labels, count, [&](MetricGroup& group) { return makeHistogram(group.buckets(bounds), sharding); });
+        }
+
+        Histogram getHistogram(const std::string& name, const Labels& labels, shared_ptr<const IHistogramBuckets> buckets, Sharding sharding) override {
+            return get<Histogram>(name, labels, [&](MetricGroup&) { return makeHistogram(buckets, sharding); });
+        }
+
+        Histogram getIntegerHistogram(const std::string& name, const Labels& labels, const vector<uint64_t>& bounds, double unit) override {
+            return get<Histogram>(name, labels, [&](MetricGroup&) { return makeIntegerHistogram(bounds, unit); });
+        }
+
+        ExponentialHistogram getExponentialHistogram(const std::string& name, const Labels& labels, int32_t scale, size_t maxBuckets, double zeroThreshold) override {
+            return get<ExponentialHistogram>(name, labels, [&](MetricGroup&) { return makeExponentialHistogram(scale, maxBuckets, zeroThreshold); });
+        }
+
+        shared_ptr<IFamily> getFamily(const std::string& name, const vector<string>& labelNames, function<shared_ptr<IMetric>(const Labels&)> create) override
+        {
+            function<bool(const IMetric&)> cacheable;
+            if (m_budget.limited()) {
+                weak_ptr<IRegistry> registry = shared_from_this();
+                cacheable = [registry, name](const IMetric& metric) {
+                    auto self = registry.lock();
+                    return self && !static_cast<RegistryImpl&>(*self).isOverflow(name, metric);
+                };
+            }
+            auto family = makeFamily(labelNames, move(create), move(cacheable), false);
+            unique_lock<mutex> lock(m_familiesMutex);
+            // Families released by callers are dropped here too, so that repeated lookups do not accumulate entries
+            auto range = m_families.equal_range(name);
+            for (auto it = range.first; it != range.second;)
+                it = it->second.expired() ? m_families.erase(it) : next(it);
+            m_families.emplace(name, family);
+            return family;
         }
 
         virtual bool add(shared_ptr<IMetric> metric, const std::string& name, const Labels& labels) override
         {
-            auto& group = getOrCreateGroup(name, metric->type());
-            return group.add(labels, metric);
+            auto& group = getOrCreateGroup(shard(name), name, metric->type());
+            return group.second.add(labels, metric);
+        }
+
+        bool isOverflow(const string& name, const IMetric& metric) const
+        {
+            Shard& s = shard(name);
+            const MetricGroup* group;
+            {
+                unique_lock<mutex> lock(s.mutex);
+                auto it = s.groups.find(name);
+                if (it == s.groups.end())
+                    return false;
+                group = &it->second;
+            }
+            return group->isOverflow(metric);
+        }
+
+        bool remove(const std::string& name, const Labels& labels) override
+        {
+            const uint64_t nameHash = KeyHash().add(name).value();
+            Shard& s = shard(nameHash);
+            MetricGroup* group;
+            {
+                unique_lock<mutex> lock(s.mutex);
+                auto it = s.groups.find(name);
+                if (it == s.groups.end())
+                    return false;
+                group = &it->second;
+            }
+            auto removed = group->remove(labels, s.index, nameHash);
+            release(name, removed);
+            m_symbols.sweep();
+            return !removed.empty();
+        }
+
+        void expire() override
+        {
+            if (m_expireAfter == chrono::steady_clock::duration::zero())
+                return;
+            // Changes observed here are attributed to a generation later than of any snapshot collected before, so that next snapshots report them
+            unique_lock<mutex> collection(m_collectionMutex);
+            const uint64_t generation = nextCollectionGeneration();
+            const auto now = chrono::steady_clock::now();
+            for (size_t i = 0; i < m_shardCount; i++) {
+                Shard& s = m_shards[i];
+                // Groups are never removed, so they may be used after shard lock is released
+                vector<pair<const string*, MetricGroup*>> groups;
+                {
+                    unique_lock<mutex> lock(s.mutex);
+                    for (auto& g : s.groups)
+                        groups.emplace_back(&g.first, &g.second);
+                }
+                for (const auto& g : groups)
+                    release(*g.first, g.second->expire(m_expireAfter, generation, now, s.index, KeyHash().add(*g.first).value()));
+            }
+            m_symbols.sweep();
         }
 
         // Inherited via IRegistry
         vector<string> metricNames() const override
         {
-            unique_lock<mutex> lock(m_mutex);
             vector<string> result;
-            result.reserve(m_groups.size());
-            for (const auto& g : m_groups)
-                result.push_back(g.first);
+            for (size_t i = 0; i < m_shardCount; i++) {
+                unique_lock<mutex> lock(m_shards[i].mutex);
+                for (const auto& g : m_shards[i].groups)
+                    result.push_back(g.first);
+            }
+            // Each shard is ordered by name; merged result is sorted so that order does not depend on shard count
+            if (m_shardCount > 1)
+                sort(result.begin(), result.end());
             return result;
         }
 
         virtual void setDescription(const std::string& name, const std::string& description) override
         {
-            unique_lock<mutex> lock(m_mutex);
-            auto it = m_groups.find(name);
-            if (it != m_groups.end())
+            Shard& s = shard(name);
+            unique_lock<mutex> lock(s.mutex);
+            auto it = s.groups.find(name);
+            if (it != s.groups.end())
                 it->second.setDescription(description);
         }
 
+        void collect(RegistrySnapshot& snapshot, uint64_t since) override
+        {
+            unique_lock<mutex> collection(m_collectionMutex);
+            snapshot.keepAlive(m_symbols.pin());
+            // Allocated under collection lock, so that changes observed here are attributed to a generation later
+            // than of any snapshot of this registry collected before, even by another collector
+            const uint64_t generation = nextCollectionGeneration();
+            snapshot.addGeneration(generation);
+            const auto now = chrono::steady_clock::now();
+            const size_t first = snapshot.groupCount();
+            for (size_t i = 0; i < m_shardCount; i++) {
+                // Groups are never removed, so they may be used after shard lock is released
+                vector<pair<const string*, MetricGroup*>> groups;
+                {
+                    unique_lock<mutex> lock(m_shards[i].mutex);
+                    groups.reserve(m_shards[i].groups.size());
+                    for (auto& g : m_shards[i].groups)
+                        groups.emplace_back(&g.first, &g.second);
+                }
+                for (const auto& g : groups)
+                    g.second->snapshot(*g.first, snapshot, since, generation, now);
+            }
+            if (m_shardCount > 1)
+                snapshot.sortGroups(first);
+        }
+
         virtual size_t size() const override
         {
             size_t result = 0;
-            unique_lock<mutex> lock(m_mutex);
-            for (const auto& g : m_groups)
-                result += g.second.size();
+            for (size_t i = 0; i < m_shardCount; i++) {
+                unique_lock<mutex> lock(m_shards[i].mutex);
+                for (const auto& g : m_shards[i].groups)
+                    result += g.second.size();
+            }
             return result;
         }
     };
@@ -202,6 +853,13 @@ namespace Metrics {
 
     METRICS_EXPORT shared_ptr<IRegistry> createRegistry()
     {
-        return make_shared<RegistryImpl>();
+        return createRegistry(RegistryOptions());
+    };
+
+    METRICS_EXPORT shared_ptr<IRegistry> createRegistry(const RegistryOptions& options)
+    {
+        if (options.shards == 0)
+            throw logic_error("Registry requires at least one shard");
+        return make_shared<RegistryImpl>(options);
     };
 }
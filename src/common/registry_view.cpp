@@ -0,0 +1,287 @@
+#include <metrics/registry.h>
+
+#include <algorithm>
+#include <set>
+#include <stdexcept>
+
+using namespace std;
+
+namespace Metrics {
+    // Forwards all operations to underlying registry; only collected snapshots are decorated with
+    // prefix and constant labels, which reference strings owned by the view
+    class RegistryView : public IRegistry
+    {
+    private:
+        const shared_ptr<IRegistry> m_registry;
+        const string m_prefix;
+        const Labels m_labels;
+        vector<LabelRef> m_labelRefs;
+
+    public:
+        RegistryView(shared_ptr<IRegistry> registry, const string& prefix, const Labels& labels) :
+            m_registry(registry),
+            m_prefix(prefix),
+            m_labels(labels)
+        {
+            for (auto it = m_labels.cbegin(); it != m_labels.cend(); it++)
+                m_labelRefs.push_back(LabelRef{ &it->first, &it->second });
+        }
+
+        const shared_ptr<IRegistry>& registry() const { return m_registry; }
+        const string& prefix() const { return m_prefix; }
+        const Labels& labels() const { return m_labels; }
+
+        void collect(RegistrySnapshot& snapshot, uint64_t since) override
+        {
+            const size_t first = snapshot.groupCount();
+            m_registry->collect(snapshot, since);
+            const LabelRef* labels = m_labelRefs.data();
+            snapshot.decorateGroups(first, m_prefix.empty() ? nullptr : &m_prefix, labels, labels + m_labelRefs.size());
+        }
+
+        vector<string> metricNames() const override { return m_registry->metricNames(); }
+        const IMetricGroup& getGroup(const string& name) const override { return m_registry->getGroup(name); }
+        size_t size() const override { return m_registry->size(); }
+
+        Gauge getGauge(const string& name, const Labels& labels, GaugeKind kind, Sharding sharding) override
+        {
+            return m_registry->getGauge(name, labels, kind, sharding);
+        }
+
+        Gauge getGauge(StringView name, const LabelView* labels, size_t count, GaugeKind kind, Sharding sharding) override
+        {
+            return m_registry->getGauge(name, labels, count, kind, sharding);
+        }
+
+        Counter getCounter(const string& name, const Labels& labels, Sharding sharding) override
+        {
+            return m_registry->getCounter(name, labels, sharding);
+        }
+
+        Counter getCounter(StringView name, const LabelView* labels, size_t count, Sharding sharding) override
+        {
+            return m_registry->getCounter(name, labels, count, sharding);
+        }
+
+        CounterRef getCounterRef(const string& name, const Labels& labels, Sharding sharding) override
+        {
+            return m_registry->getCounterRef(name, labels, sharding);
+        }
+
+        GaugeRef getGaugeRef(const string& name, const Labels& labels, GaugeKind kind, Sharding sharding) override
+        {
+            return m_registry->getGaugeRef(name, labels, kind, sharding);
+        }
+
+        Summary getSummary(const string& name, const Labels& labels, const vector<double>& quantiles, double error) override
+        {
+            return m_registry->getSummary(name, labels, quantiles, error);
+        }
+
+        Summary getSummary(const string& name, const Labels& labels, const vector<double>& quantiles, double error, chrono::steady_clock::duration maxAge, size_t ageBuckets) override
+        {
+            return m_registry->getSummary(name, labels, quantiles, error, maxAge, ageBuckets);
+        }
+
+        Summary getHdrSummary(const string& name, const Labels& labels, const vector<double>& quantiles, uint64_t highest, int significantDigits) override
+        {
+            return m_registry->getHdrSummary(name, labels, quantiles, highest, significantDigits);
+        }
+
+        Histogram getHistogram(const string& name, const Labels& labels, const vector<double>& bounds, Sharding sharding) override
+        {
+            return m_registry->getHistogram(name, labels, bounds, sharding);
+        }
+
+        Histogram getHistogram(StringView name, const LabelView* labels, size_t count, const vector<double>& bounds, Sharding sharding) override
+        {
+            return m_registry->getHistogram(name, labels, count, bounds, sharding);
+        }
+
+        Histogram getHistogram(const string& name, const Labels& labels, shared_ptr<const IHistogramBuckets> buckets, Sharding sharding) override
+        {
+            return m_registry->getHistogram(name, labels, buckets, sharding);
+        }
+
+        Histogram getIntegerHistogram(const string& name, const Labels& labels, const vector<uint64_t>& bounds, double unit) override
+        {
+            return m_registry->getIntegerHistogram(name, labels, bounds, unit);
+        }
+
+        ExponentialHistogram getExponentialHistogram(const string& name, const Labels& labels, int32_t scale, size_t maxBuckets, double zeroThreshold) override
+        {
+            return m_registry->getExponentialHistogram(name, labels, scale, maxBuckets, zeroThreshold);
+        }
+
+        shared_ptr<IFamily> getFamily(const string& name, const vector<string>& labelNames, function<shared_ptr<IMetric>(const Labels&)> create) override
+        {
+            return m_registry->getFamily(name, labelNames, move(create));
+        }
+
+        bool add(shared_ptr<IMetric> metric, const string& name, const Labels& labels) override { return m_registry->add(metric, name, labels); }
+        bool remove(const string& name, const Labels& labels) override { return m_registry->remove(name, labels); }
+        void expire() override { m_registry->expire(); }
+        void setDescription(const string& name, const string& description) override { m_registry->setDescription(name, description); }
+    };
+
+    // Collects all registries into one snapshot. Metrics cannot be created through it, since it is
+    // ambiguous which registry should own them
+    class CompositeRegistry : public IRegistry
+    {
+    private:
+        const vector<shared_ptr<IRegistry>> m_registries;
+
+        [[noreturn]] static void readOnly()
+        {
+            throw logic_error("Composite registry is read-only");
+        }
+
+        struct LabelSetLess
+        {
+            static bool less(const LabelRef& l, const LabelRef& r)
+            {
+                return *l.name != *r.name ? *l.name < *r.name : *l.value < *r.value;
+            }
+
+            bool operator()(const vector<LabelRef>& l, const vector<LabelRef>& r) const
+            {
+                return lexicographical_compare(l.begin(), l.end(), r.begin(), r.end(), less);
+            }
+        };
+
+        // Groups of different registries with same full name are exposed as one metric, so they must have
+        // the type of the first group and distinct label sets. Conflicting groups and series are dropped,
+        // i.e. the registry listed first wins
+        static void removeConflicts(RegistrySnapshot& snapshot, size_t first)
+        {
+            bool merged = false;
+            for (size_t i = first + 1; i < snapshot.groupCount() && !merged; i++)
+                merged = snapshot.group(i - 1).compare(snapshot.group(i)) == 0;
+            if (!merged)
+                return;
+
+            size_t current = snapshot.groupCount();
+            size_t head = current;
+            bool alone = true;
+            set<vector<LabelRef>, LabelSetLess> seen;
+            vector<LabelRef> key;
+            snapshot.removeSeries(first, [&](size_t index, size_t series) {
+                const auto& group = snapshot.group(index);
+                if (index != current) {
+                    current = index;
+                    size_t start = index;
+                    while (start > first && snapshot.group(start - 1).compare(group) == 0)
+                        start--;
+                    if (start != head) {
+                        head = start;
+                        seen.clear();
+                    }
+                    alone = start == index && (index + 1 == snapshot.groupCount() || snapshot.group(index + 1).compare(group) != 0);
+                }
+                if (alone)
+                    return false;
+                if (group.type != snapshot.group(head).type)
+                    return true;
+                const LabelRange own = snapshot.labels(series);
+                key.clear();
+                for (const auto& label : group.labels())
+                    if (!own.contains(*label.name))
+                        key.push_back(label);
+                key.insert(key.end(), own.begin(), own.end());
+                sort(key.begin(), key.end(), LabelSetLess::less);
+                return !seen.insert(key).second;
+            });
+        }
+
+    public:
+        CompositeRegistry(const vector<shared_ptr<IRegistry>>& registries) : m_registries(registries) {}
+
+        void collect(RegistrySnapshot& snapshot, uint64_t since) override
+        {
+            const size_t first = snapshot.groupCount();
+            for (const auto& registry : m_registries)
+                registry->collect(snapshot, since);
+            snapshot.sortGroups(first);
+            removeConflicts(snapshot, first);
+        }
+
+        vector<string> metricNames() const override
+        {
+            vector<string> result;
+            for (const auto& registry : m_registries) {
+                auto names = registry->metricNames();
+                result.insert(result.end(), names.begin(), names.end());
+            }
+            sort(result.begin(), result.end());
+            result.erase(unique(result.begin(), result.end()), result.end());
+            return result;
+        }
+
+        // Group of the first registry which has metrics with given name
+        const IMetricGroup& getGroup(const string& name) const override
+        {
+            for (const auto& registry : m_registries) {
+                auto names = registry->metricNames();
+                if (binary_search(names.begin(), names.end(), name))
+                    return registry->getGroup(name);
+            }
+            throw logic_error("Group not found");
+        }
+
+        size_t size() const override
+        {
+            size_t result = 0;
+            for (const auto& registry : m_registries)
+                result += registry->size();
+            return result;
+        }
+
+        void expire() override
+        {
+            for (const auto& registry : m_registries)
+                registry->expire();
+        }
+
+        Gauge getGauge(const string&, const Labels&, GaugeKind, Sharding) override { readOnly(); }
+        Gauge getGauge(StringView, const LabelView*, size_t, GaugeKind, Sharding) override { readOnly(); }
+        Counter getCounter(const string&, const Labels&, Sharding) override { readOnly(); }
+        Counter getCounter(StringView, const LabelView*, size_t, Sharding) override { readOnly(); }
+        CounterRef getCounterRef(const string&, const Labels&, Sharding) override { readOnly(); }
+        GaugeRef getGaugeRef(const string&, const Labels&, GaugeKind, Sharding) override { readOnly(); }
+        Summary getSummary(const string&, const Labels&, const vector<double>&, double) override { readOnly(); }
+        Summary getSummary(const string&, const Labels&, const vector<double>&, double, chrono::steady_clock::duration, size_t) override { readOnly(); }
+        Summary getHdrSummary(const string&, const Labels&, const vector<double>&, uint64_t, int) override { readOnly(); }
+        Histogram getHistogram(const string&, const Labels&, const vector<double>&, Sharding) override { readOnly(); }
+        Histogram getHistogram(StringView, const LabelView*, size_t, const vector<double>&, Sharding) override { readOnly(); }
+        Histogram getHistogram(const string&, const Labels&, shared_ptr<const IHistogramBuckets>, Sharding) override { readOnly(); }
+        Histogram getIntegerHistogram(const string&, const Labels&, const vector<uint64_t>&, double) override { readOnly(); }
+        ExponentialHistogram getExponentialHistogram(const string&, const Labels&, int32_t, size_t, double) override { readOnly(); }
+        shared_ptr<IFamily> getFamily(const string&, const vector<string>&, function<shared_ptr<IMetric>(const Labels&)>) override { readOnly(); }
+        bool add(shared_ptr<IMetric>, const string&, const Labels&) override { readOnly(); }
+        bool remove(const string&, const Labels&) override { readOnly(); }
+        void setDescription(const string&, const string&) override { readOnly(); }
+    };
+
+    shared_ptr<IRegistry> createRegistryView(shared_ptr<IRegistry> registry, const string& prefix, const Labels& labels)
+    {
+        if (!registry)
+            throw logic_error("Registry view requires a registry");
+
+        // View of a view is flattened, so that snapshots are decorated once
+        if (auto view = dynamic_pointer_cast<RegistryView>(registry)) {
+            Labels combined = view->labels();
+            for (auto it = labels.cbegin(); it != labels.cend(); it++)
+                combined[it->first] = it->second;
+            return make_shared<RegistryView>(view->registry(), prefix + view->prefix(), combined);
+        }
+        return make_shared<RegistryView>(registry, prefix, labels);
+    }
+
+    shared_ptr<IRegistry> createCompositeRegistry(const vector<shared_ptr<IRegistry>>& registries)
+    {
+        for (const auto& registry : registries)
+            if (!registry)
+                throw logic_error("Composite registry requires non-empty registries");
+        return make_shared<CompositeRegistry>(registries);
+    }
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <thread>
+
+namespace Metrics {
+    // Size used to pad per-thread data so that two shards never share a cache line
+    constexpr size_t CacheLineSize = 64;
+
+    // Small stable number identifying the calling thread, assigned round-robin on first use
+    inline size_t threadIndex()
+    {
+        static std::atomic<size_t> s_next(0);
+        static thread_local size_t t_index = s_next.fetch_add(1, std::memory_order_relaxed);
+        return t_index;
+    }
+
+    // Number of shards used by sharded metrics - hardware concurrency rounded up to a power of two
+    inline size_t shardCount()
+    {
+        static const size_t s_count = [] {
+            size_t threads = std::thread::hardware_concurrency();
+            size_t count = 1;
+            while (count < threads && count < 64)
+                count <<= 1;
+            return count;
+        }();
+        return s_count;
+    }
+
+    // Fixed number of rows of `width` elements, one row per shard. Each row starts on its own
+    // cache line, so threads writing to their own row do not invalidate each other's caches
+    template<typename T> class ShardedArray {
+    private:
+        const size_t m_width;
+        const size_t m_stride;
+        const size_t m_shards;
+        std::unique_ptr<unsigned char[]> m_buffer;
+        T* m_data;
+
+        static constexpr size_t gcd(size_t a, size_t b) { return b == 0 ? a : gcd(b, a % b); }
+
+        // Rows span whole cache lines: stride is rounded up to a multiple of the smallest element count
+        // whose size is a multiple of cache line size, which matters when sizeof(T) does not divide it
+        static size_t stride(size_t width)
+        {
+            const size_t unit = CacheLineSize / gcd(sizeof(T), CacheLineSize);
+            return (width + unit - 1) / unit * unit;
+        }
+
+    public:
+        ShardedArray(size_t width, size_t shards = shardCount()) :
+            m_width(width),
+            m_stride(stride(width)),
+            m_shards(shards),
+            m_buffer(new unsigned char[m_stride * m_shards * sizeof(T) + CacheLineSize])
+        {
+            // operator new does not honor over-alignment before C++17, so align manually
+            auto address = reinterpret_cast<uintptr_t>(m_buffer.get());
+            auto aligned = (address + CacheLineSize - 1) & ~(uintptr_t)(CacheLineSize - 1);
+            m_data = reinterpret_cast<T*>(aligned);
+            for (size_t i = 0; i < m_stride * m_shards; i++)
+                new (m_data + i) T();
+        }
+
+        ShardedArray(const ShardedArray&) = delete;
+        ShardedArray& operator=(const ShardedArray&) = delete;
+
+        ~ShardedArray()
+        {
+            for (size_t i = 0; i < m_stride * m_shards; i++)
+                m_data[i].~T();
+        }
+
+        size_t shards() const { return m_shards; }
+        size_t width() const { return m_width; }
+
+        T* row(size_t shard) { return m_data + shard * m_stride; }
+        const T* row(size_t shard) const { return m_data + shard * m_stride; }
+
+        // Row owned by the calling thread. Threads beyond shard count share rows round-robin
+        T* local() { return row(threadIndex() & (m_shards - 1)); }
+    };
+}
@@ -0,0 +1,280 @@
+#include <metrics/metric.h>
+
+#include "common/epoch.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+using std::atomic;
+using std::logic_error;
+using std::memory_order_acquire;
+using std::memory_order_acq_rel;
+using std::memory_order_relaxed;
+using std::memory_order_release;
+using std::mutex;
+using std::pair;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+
+namespace Metrics {
+    // Scale range of OpenTelemetry exponential histograms. At minimum scale, 3 buckets cover all doubles
+    constexpr int32_t MinScale = -10;
+    constexpr int32_t MaxScale = 20;
+
+    // Size of bucket windows when first allocated
+    constexpr size_t InitialBuckets = 8;
+
+    static int32_t floorDiv(int32_t value, int32_t divisor)
+    {
+        int32_t result = value / divisor;
+        return (value % divisor != 0 && value < 0) ? result - 1 : result;
+    }
+
+    // Index of bucket (base^i, base^(i+1)] containing a positive finite value
+    static int32_t bucketIndex(double value, int32_t scale)
+    {
+        int exponent;
+        const double fraction = std::frexp(value, &exponent); // value = fraction * 2^exponent, fraction in [0.5, 1)
+        const bool powerOfTwo = fraction == 0.5;
+
+        if (scale <= 0) {
+            // Exact computation from the exponent. Power of two is upper bound of the previous bucket
+            const int32_t e = exponent - 1 - (powerOfTwo ? 1 : 0);
+            return floorDiv(e, 1 << -scale);
+        }
+
+        if (powerOfTwo)
+            return (exponent - 1) * (1 << scale) - 1;
+
+        static const double invLn2 = 1. / std::log(2.);
+        return (int32_t)std::floor(std::log(value) * std::ldexp(invLn2, scale));
+    }
+
+    double ExponentialBuckets::lowerBound(int32_t scale, int32_t index)
+    {
+        return std::exp2(std::ldexp((double)index, -scale));
+    }
+
+    // Fixed-capacity circular window of bucket counters. Populated index range is kept in a
+    // single atomic word, so that concurrent writers can extend it without locks. A window of
+    // size 0 holds no counters and accepts no buckets
+    class BucketWindow {
+    private:
+        const size_t m_size;
+        unique_ptr<atomic<uint64_t>[]> m_counts;
+        atomic<uint64_t> m_range;
+
+        static const uint64_t Empty = 0x7FFFFFFF80000000ull; // low > high
+
+        static uint64_t pack(int32_t low, int32_t high) { return ((uint64_t)(uint32_t)low << 32) | (uint32_t)high; }
+        static int32_t low(uint64_t range) { return (int32_t)(uint32_t)(range >> 32); }
+        static int32_t high(uint64_t range) { return (int32_t)(uint32_t)range; }
+
+        size_t slot(int32_t index) const
+        {
+            int64_t result = index % (int64_t)m_size;
+            return (size_t)(result < 0 ? result + (int64_t)m_size : result);
+        }
+
+    public:
+        BucketWindow(size_t size) : m_size(size), m_counts(size != 0 ? new atomic<uint64_t>[size]() : nullptr), m_range(Empty) {}
+
+        size_t size() const { return m_size; }
+
+        // Checks whether a window of given size could hold both the current range and index at a scale reduced by delta
+        bool fits(int32_t index, int32_t delta, size_t size) const
+        {
+            const uint64_t range = m_range.load(memory_order_acquire);
+            int64_t lo = floorDiv(index, 1 << delta), hi = lo;
+            if (range != Empty) {
+                lo = std::min<int64_t>(lo, floorDiv(low(range), 1 << delta));
+                hi = std::max<int64_t>(hi, floorDiv(high(range), 1 << delta));
+            }
+            return hi - lo < (int64_t)size;
+        }
+
+        // Adds count to the bucket. Returns false if the bucket does not fit in the window
+        bool add(int32_t index, uint64_t count)
+        {
+            uint64_t range = m_range.load(memory_order_acquire);
+            for (;;) {
+                const int32_t lo = range == Empty ? index : std::min(low(range), index);
+                const int32_t hi = range == Empty ? index : std::max(high(range), index);
+                if ((int64_t)hi - lo >= (int64_t)m_size)
+                    return false;
+                const uint64_t updated = pack(lo, hi);
+                if (updated == range || m_range.compare_exchange_weak(range, updated, memory_order_acq_rel))
+                    break;
+            }
+            m_counts[slot(index)].fetch_add(count, memory_order_relaxed);
+            return true;
+        }
+
+        uint64_t get(int32_t index) const { return m_counts[slot(index)].load(memory_order_acquire); }
+
+        vector<pair<int32_t, uint64_t>> values() const
+        {
+            vector<pair<int32_t, uint64_t>> result;
+            const uint64_t range = m_range.load(memory_order_acquire);
+            if (range == Empty)
+                return result;
+            for (int64_t i = low(range); i <= high(range); i++) {
+                auto count = get((int32_t)i);
+                if (count != 0)
+                    result.emplace_back((int32_t)i, count);
+            }
+            return result;
+        }
+    };
+
+    // Recording is lock-free: writers only take the mutex when a value does not fit into the
+    // current bucket windows, which then grow or the scale is reduced. Both can happen a bounded
+    // number of times over the lifetime of the histogram. Windows start small, and the window of
+    // negative values is allocated when the first one is recorded
+    class ExponentialHistogramImpl : public IExponentialHistogram {
+    private:
+        struct State {
+            const int32_t scale;
+            BucketWindow positive;
+            BucketWindow negative;
+
+            State(int32_t scale, size_t positiveSize, size_t negativeSize) : scale(scale), positive(positiveSize), negative(negativeSize) {}
+        };
+
+        const size_t m_maxBuckets;
+        const double m_zeroThreshold;
+        atomic<State*> m_state; // nullptr while windows are replaced; writers access it under EpochGuard
+        atomic<uint64_t> m_count;
+        atomic<uint64_t> m_zeroCount;
+        atomic<double> m_sum;
+        ModificationStamp m_modified;
+
+        // Guards replacement of windows and readers
+        mutable mutex m_mutex;
+
+        // Replaces windows by ones which can hold value: the window which value does not fit into is doubled
+        // up to maxBuckets, after which scale is reduced until the bucket of value fits
+        void resize(double value)
+        {
+            unique_lock<mutex> lock(m_mutex);
+            State* state = m_state.load();
+            const bool positive = value > 0;
+            const BucketWindow& target = positive ? state->positive : state->negative;
+            int32_t index = bucketIndex(std::fabs(value), state->scale);
+            if (target.fits(index, 0, target.size()))
+                return; // Another writer already replaced windows - retry with the new ones
+
+            size_t size = target.size() != 0 ? target.size() : std::min(InitialBuckets, m_maxBuckets);
+            while (size < m_maxBuckets && !target.fits(index, 0, size))
+                size = std::min(size * 2, m_maxBuckets);
+            int32_t delta = 0;
+            while (state->scale - delta > MinScale && !target.fits(index, delta, size))
+                delta++;
+
+            // Block new writers and wait for those which may still write to the old windows
+            m_state.store(nullptr);
+            EpochDomain::instance().synchronize();
+
+            auto next = new State(state->scale - delta, positive ? size : state->positive.size(), positive ? state->negative.size() : size);
+            merge(state->positive, next->positive, delta);
+            merge(state->negative, next->negative, delta);
+            m_state.store(next);
+            delete state;
+        }
+
+        static void merge(const BucketWindow& from, BucketWindow& to, int32_t delta)
+        {
+            for (const auto& bucket : from.values())
+                to.add(floorDiv(bucket.first, 1 << delta), bucket.second);
+        }
+
+        void record(double value)
+        {
+            m_count.fetch_add(1, memory_order_relaxed);
+            double oldv = m_sum.load(memory_order_relaxed);
+            while (!m_sum.compare_exchange_weak(oldv, oldv + value, memory_order_relaxed))
+                ;
+
+            const double magnitude = std::fabs(value);
+            if (magnitude <= m_zeroThreshold) {
+                m_zeroCount.fetch_add(1, memory_order_relaxed);
+                return;
+            }
+
+            for (;;) {
+                bool replacing;
+                {
+                    EpochGuard guard;
+                    State* state = m_state.load();
+                    replacing = state == nullptr;
+                    if (!replacing && (value > 0 ? state->positive : state->negative).add(bucketIndex(magnitude, state->scale), 1))
+                        return;
+                }
+                // Locks are taken outside of guard, since windows are replaced under the lock
+                if (replacing) {
+                    unique_lock<mutex> wait(m_mutex);
+                }
+                else {
+                    resize(value);
+                }
+            }
+        }
+
+    public:
+        ExponentialHistogramImpl(int32_t scale, size_t maxBuckets, double zeroThreshold) :
+            m_maxBuckets(maxBuckets),
+            m_zeroThreshold(zeroThreshold),
+            m_count(0),
+            m_zeroCount(0),
+            m_sum(0.)
+        {
+            m_state.store(new State(std::min(std::max(scale, MinScale), MaxScale), std::min(InitialBuckets, maxBuckets), 0));
+        }
+
+        ~ExponentialHistogramImpl() { delete m_state.load(); }
+
+        ExponentialHistogramImpl(const ExponentialHistogramImpl&) = delete;
+
+        IExponentialHistogram& observe(double value) override
+        {
+            if (!std::isfinite(value))
+                return *this;
+
+            record(value);
+            m_modified.touch();
+            return *this;
+        }
+
+        uint64_t count() const override { return m_count.load(memory_order_acquire); }
+
+        double sum() const override { return m_sum.load(memory_order_acquire); }
+
+        ExponentialBuckets values() const override
+        {
+            unique_lock<mutex> lock(m_mutex);
+            const State* state = m_state.load();
+            ExponentialBuckets result;
+            result.scale = state->scale;
+            result.zeroThreshold = m_zeroThreshold;
+            result.zeroCount = m_zeroCount.load(memory_order_acquire);
+            result.positive = state->positive.values();
+            result.negative = state->negative.values();
+            return result;
+        }
+
+        ModificationStamp* modificationStamp() override { return &m_modified; }
+    };
+
+    std::shared_ptr<IExponentialHistogram> makeExponentialHistogram(int32_t scale, size_t maxBuckets, double zeroThreshold)
+    {
+        if (maxBuckets < 4)
+            throw logic_error("Exponential histogram requires at least 4 buckets");
+        return std::make_shared<ExponentialHistogramImpl>(scale, maxBuckets, zeroThreshold);
+    }
+}
@@ -0,0 +1,170 @@
+#include <metrics/metric.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+using std::atomic;
+using std::logic_error;
+using std::memory_order_relaxed;
+using std::pair;
+using std::sort;
+using std::unique_ptr;
+using std::vector;
+
+namespace Metrics {
+    // Index of the highest set bit. Value must not be zero
+    static inline uint32_t highestBit(uint64_t value)
+    {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanReverse64(&index, value);
+        return index;
+#else
+        return 63 - __builtin_clzll(value);
+#endif
+    }
+
+    // Log-linear histogram as in HdrHistogram (G. Tene): values are split into power-of-two
+    // buckets, each divided into linear sub-buckets, which gives constant relative precision
+    // over the whole range. Counters live in one flat array, so recording is a single atomic
+    // increment at a computed index; quantiles are extracted when read
+    class HdrSummaryImpl : public ISummary {
+    private:
+        const vector<double> m_quantiles;
+        const uint64_t m_highest;
+        const uint32_t m_subBucketHalfBits;
+        const uint64_t m_subBucketMask;
+        size_t m_size;
+        unique_ptr<atomic<uint64_t>[]> m_counts;
+        atomic<uint64_t> m_sum;
+        ModificationStamp m_modified;
+
+        size_t index(uint64_t value) const
+        {
+            const uint32_t bucket = highestBit(value | m_subBucketMask) - m_subBucketHalfBits;
+            const uint64_t subBucket = value >> bucket;
+            return ((size_t)bucket << m_subBucketHalfBits) + (size_t)subBucket;
+        }
+
+        uint64_t clamp(double value) const
+        {
+            return !(value > 0) ? 0 : value >= (double)m_highest ? m_highest : (uint64_t)std::llround(value);
+        }
+
+        // Highest value which is recorded at the index
+        uint64_t highestEquivalent(size_t index) const
+        {
+            const uint32_t bucket = index < (size_t(2) << m_subBucketHalfBits) ? 0 : (uint32_t)(index >> m_subBucketHalfBits) - 1;
+            const uint64_t subBucket = index - ((size_t)bucket << m_subBucketHalfBits);
+            return ((subBucket + 1) << bucket) - 1;
+        }
+
+    public:
+        HdrSummaryImpl(const vector<double>& quantiles, uint64_t highest, int significantDigits) :
+            m_quantiles(quantiles),
+            m_highest(highest),
+            m_subBucketHalfBits(highestBit((uint64_t)std::ceil(2 * std::pow(10., significantDigits)) - 1)),
+            m_subBucketMask((uint64_t(2) << m_subBucketHalfBits) - 1),
+            m_sum(0)
+        {
+            m_size = index(highest) + 1;
+            m_counts.reset(new atomic<uint64_t>[m_size]());
+        }
+
+        HdrSummaryImpl(const HdrSummaryImpl&) = delete;
+
+        ISummary& observe(double value) override
+        {
+            const uint64_t v = clamp(value);
+            m_counts[index(v)].fetch_add(1, memory_order_relaxed);
+            m_sum.fetch_add(v, memory_order_relaxed);
+            m_modified.touch();
+            return *this;
+        }
+
+        // Values are processed in chunks whose indices are sorted on the stack, so that each touched
+        // counter receives one update per chunk without allocating a copy of the counter array
+        ISummary& observeMany(const double* values, size_t count) override
+        {
+            static constexpr size_t ChunkSize = 64;
+            size_t indices[ChunkSize];
+            uint64_t sum = 0;
+            for (size_t begin = 0; begin < count; begin += ChunkSize) {
+                const size_t size = std::min(ChunkSize, count - begin);
+                for (size_t i = 0; i < size; i++) {
+                    const uint64_t v = clamp(values[begin + i]);
+                    indices[i] = index(v);
+                    sum += v;
+                }
+                sort(indices, indices + size);
+                for (size_t i = 0; i < size;) {
+                    size_t j = i + 1;
+                    while (j < size && indices[j] == indices[i])
+                        j++;
+                    m_counts[indices[i]].fetch_add(j - i, memory_order_relaxed);
+                    i = j;
+                }
+            }
+            m_sum.fetch_add(sum, memory_order_relaxed);
+            m_modified.touch();
+            return *this;
+        }
+
+        vector<pair<double, uint64_t>> values() const override
+        {
+            vector<uint64_t> counts(m_size);
+            uint64_t total = 0;
+            for (size_t i = 0; i < m_size; i++)
+                total += counts[i] = m_counts[i].load(memory_order_relaxed);
+
+            vector<pair<double, uint64_t>> result;
+            size_t i = 0;
+            uint64_t cumulative = 0;
+            for (auto q : m_quantiles) {
+                if (total == 0) {
+                    result.emplace_back(q, 0);
+                    continue;
+                }
+                const uint64_t rank = std::max<uint64_t>(1, (uint64_t)std::ceil(q * total));
+                for (; i < m_size && cumulative + counts[i] < rank; i++)
+                    cumulative += counts[i];
+                result.emplace_back(q, std::min(highestEquivalent(std::min(i, m_size - 1)), m_highest));
+            }
+            return result;
+        }
+
+        uint64_t count() const override
+        {
+            uint64_t total = 0;
+            for (size_t i = 0; i < m_size; i++)
+                total += m_counts[i].load(memory_order_relaxed);
+            return total;
+        }
+
+        double sum() const override
+        {
+            return (double)m_sum.load(memory_order_relaxed);
+        }
+
+        ModificationStamp* modificationStamp() override { return &m_modified; }
+    };
+
+    std::shared_ptr<ISummary> makeHdrSummary(const vector<double>& quantiles, uint64_t highest, int significantDigits)
+    {
+        if (significantDigits < 1 || significantDigits > 5)
+            throw logic_error("HDR summary supports 1 to 5 significant digits");
+        if (highest < 2)
+            throw logic_error("HDR summary highest trackable value must be at least 2");
+        auto q = quantiles;
+        sort(q.begin(), q.end());
+        return std::make_shared<HdrSummaryImpl>(q, highest, significantDigits);
+    }
+}
@@ -1,74 +1,345 @@
 #include <metrics/metric.h>
 
-#include <boost/accumulators/accumulators.hpp>
-#include <boost/accumulators/statistics.hpp>
+#include "common/sharding.h"
 
 #include <algorithm>
-#include <mutex>
 #include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <vector>
-#include <list>
-#include <map>
 
+using std::atomic;
+using std::memory_order_acquire;
+using std::memory_order_relaxed;
+using std::memory_order_release;
 using std::vector;
 using std::mutex;
 using std::unique_lock;
 using std::pair;
 using std::sort;
-
-using namespace boost::accumulators;
+using std::logic_error;
+using std::chrono::steady_clock;
 
 namespace Metrics {
-    // Implements CKMS algorithm for approximate quantile calculation
-    // Utilizes locking internally. Using Histogram is recommended instead
+    // Targeted quantiles stream as described in "Effective Computation of Biased Quantiles over
+    // Data Streams" (Cormode, Korn, Muthukrishnan, Srivastava). Keeps a compressed list of samples
+    // such that each requested quantile is known with rank error not exceeding `error`. Not thread-safe
+    class CkmsStream {
+    private:
+        struct Sample {
+            double value;
+            double width; // rank difference from previous sample
+            double delta; // rank uncertainty
+        };
+
+        const vector<double> m_quantiles;
+        const double m_error;
+        vector<Sample> m_samples;
+        vector<Sample> m_merged;
+        double m_count;
+
+        // Maximum allowed rank uncertainty at rank r
+        double invariant(double r) const
+        {
+            double result = m_count + 1;
+            for (auto q : m_quantiles) {
+                const double f = r >= q * m_count ? 2 * m_error * r / q : 2 * m_error * (m_count - r) / (1 - q);
+                result = std::min(result, f);
+            }
+            return result;
+        }
+
+        void compress()
+        {
+            if (m_samples.size() < 2)
+                return;
+
+            // Walk from the end, folding each sample into its successor while the invariant allows.
+            // Surviving samples are compacted towards the end of the list
+            size_t next = m_samples.size() - 1;
+            double r = m_count - 1 - m_samples[next].width;
+            for (size_t i = next; i-- > 0;) {
+                const Sample current = m_samples[i];
+                if (current.width + m_samples[next].width + m_samples[next].delta <= invariant(r))
+                    m_samples[next].width += current.width;
+                else
+                    m_samples[--next] = current;
+                r -= current.width;
+            }
+            m_samples.erase(m_samples.begin(), m_samples.begin() + next);
+        }
+
+    public:
+        CkmsStream(const vector<double>& quantiles, double error) :
+            m_quantiles(quantiles),
+            m_error(error),
+            m_count(0)
+        {
+        }
+
+        // Inserts a sorted batch of values
+        void insert(const vector<double>& values)
+        {
+            if (values.empty())
+                return;
+
+            m_merged.clear();
+            m_merged.reserve(m_samples.size() + values.size());
+            double r = 0;
+            auto it = m_samples.begin();
+            for (auto value : values) {
+                for (; it != m_samples.end() && it->value <= value; it++) {
+                    r += it->width;
+                    m_merged.push_back(*it);
+                }
+                // New minimum and maximum are known exactly
+                const double delta = (it == m_samples.end() || m_merged.empty()) ? 0 : std::max(0., std::floor(invariant(r)) - 1);
+                m_merged.push_back({ value, 1, delta });
+                m_count++;
+                r++;
+            }
+            m_merged.insert(m_merged.end(), it, m_samples.end());
+            m_samples.swap(m_merged);
+
+            compress();
+        }
+
+        double query(double q) const
+        {
+            if (m_samples.empty())
+                return 0;
+
+            const double t = std::ceil(q * m_count) + invariant(std::ceil(q * m_count)) / 2;
+            double r = 0;
+            for (size_t i = 1; i < m_samples.size(); i++) {
+                r += m_samples[i - 1].width;
+                if (r + m_samples[i].width + m_samples[i].delta > t)
+                    return m_samples[i - 1].value;
+            }
+            return m_samples.back().value;
+        }
+
+        void reset()
+        {
+            m_samples.clear();
+            m_count = 0;
+        }
+    };
+
+    // Bounded multi-producer single-consumer queue (D. Vyukov). Producers never block;
+    // when the queue is full, the producer drains it itself
+    class SampleBuffer {
+    public:
+        static constexpr size_t Capacity = 64;
+
+    private:
+        struct Cell {
+            atomic<size_t> sequence;
+            double value;
+        };
+
+        Cell m_cells[Capacity];
+        atomic<size_t> m_enqueuePos;
+        size_t m_dequeuePos; // only accessed by the consumer, under summary lock
+
+    public:
+        SampleBuffer() : m_enqueuePos(0), m_dequeuePos(0)
+        {
+            for (size_t i = 0; i < Capacity; i++)
+                m_cells[i].sequence.store(i, memory_order_relaxed);
+        }
+
+        bool push(double value)
+        {
+            size_t pos = m_enqueuePos.load(memory_order_relaxed);
+            for (;;) {
+                Cell& cell = m_cells[pos & (Capacity - 1)];
+                const size_t sequence = cell.sequence.load(memory_order_acquire);
+                const intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+                if (diff == 0) {
+                    if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                        cell.value = value;
+                        cell.sequence.store(pos + 1, memory_order_release);
+                        return true;
+                    }
+                }
+                else if (diff < 0) {
+                    return false; // full
+                }
+                else {
+                    pos = m_enqueuePos.load(memory_order_relaxed);
+                }
+            }
+        }
+
+        // Moves completed entries to output
+        void drain(vector<double>& output)
+        {
+            for (;;) {
+                Cell& cell = m_cells[m_dequeuePos & (Capacity - 1)];
+                if (cell.sequence.load(memory_order_acquire) != m_dequeuePos + 1)
+                    return;
+                output.push_back(cell.value);
+                cell.sequence.store(m_dequeuePos + Capacity, memory_order_release);
+                m_dequeuePos++;
+            }
+        }
+    };
+
+    // Writers append to per-thread lock-free buffers. Buffers are folded into the CKMS stream
+    // under the lock when read, or by the writer that finds its buffer full. A buffer is allocated
+    // by the first writer of its shard, so that summaries updated by few threads stay small.
+    // Windowed summaries keep a ring of streams, each of which receives every value. The oldest
+    // stream answers queries and is reset when its age bucket expires, so quantiles cover values
+    // folded in during the last maxAge. Count and sum are cumulative
     class SummaryImpl : public ISummary {
     private:
-        typedef accumulator_set<double, stats<tag::extended_p_square_quantile(quadratic)> > accumulator_t;
+        const vector<double> m_quantiles;
+        const size_t m_shards;
+        std::unique_ptr<atomic<SampleBuffer*>[]> m_buffers;
 
         mutable mutex m_mutex;
-        const vector<double> m_quantiles;
-        accumulator_set<double, stats<tag::count, tag::sum, tag::tail_quantile<right>>> m_accumulator;
+        mutable vector<CkmsStream> m_streams;
+        mutable size_t m_head;
+        mutable steady_clock::time_point m_headExpires;
+        const steady_clock::duration m_streamDuration; // zero for summaries without window
+        mutable vector<double> m_batch;
+        mutable uint64_t m_count;
+        mutable double m_sum;
+        ModificationStamp m_modified;
+
+        // Must be called under lock
+        void rotate() const
+        {
+            if (m_streamDuration == steady_clock::duration::zero())
+                return;
+
+            const auto now = steady_clock::now();
+            for (size_t i = 0; i < m_streams.size() && now >= m_headExpires; i++) {
+                m_streams[m_head].reset();
+                m_head = (m_head + 1) % m_streams.size();
+                m_headExpires += m_streamDuration;
+            }
+            if (now >= m_headExpires)
+                m_headExpires = now + m_streamDuration; // All streams were reset
+        }
+
+        // Folds buffered values and, optionally, a batch of new values into streams. Must be called under lock
+        void drain(const double* values = nullptr, size_t count = 0) const
+        {
+            rotate();
+
+            m_batch.clear();
+            for (size_t i = 0; i < m_shards; i++)
+                if (SampleBuffer* buffer = m_buffers[i].load(memory_order_acquire))
+                    buffer->drain(m_batch);
+            m_batch.insert(m_batch.end(), values, values + count);
+            for (auto value : m_batch) {
+                m_count++;
+                m_sum += value;
+            }
+            sort(m_batch.begin(), m_batch.end());
+            for (auto& stream : m_streams)
+                stream.insert(m_batch);
+        }
 
     public:
-        SummaryImpl(const vector<double>& quantiles, double error) :
+        SummaryImpl(const vector<double>& quantiles, double error, steady_clock::duration maxAge, size_t ageBuckets) :
             m_quantiles(quantiles),
-            m_accumulator(tag::tail<right>::cache_size = 100)
+            m_shards(shardCount()),
+            m_buffers(new atomic<SampleBuffer*>[m_shards]),
+            m_streams(ageBuckets, CkmsStream(quantiles, error)),
+            m_head(0),
+            m_headExpires(steady_clock::now() + maxAge / ageBuckets),
+            m_streamDuration(maxAge / ageBuckets),
+            m_count(0),
+            m_sum(0)
         {
+            for (size_t i = 0; i < m_shards; i++)
+                m_buffers[i].store(nullptr, memory_order_relaxed);
         }
 
         SummaryImpl(const SummaryImpl&) = delete;
 
+        ~SummaryImpl()
+        {
+            for (size_t i = 0; i < m_shards; i++)
+                delete m_buffers[i].load(memory_order_relaxed);
+        }
+
+        SampleBuffer* localBuffer()
+        {
+            atomic<SampleBuffer*>& slot = m_buffers[threadIndex() & (m_shards - 1)];
+            SampleBuffer* buffer = slot.load(memory_order_acquire);
+            if (buffer)
+                return buffer;
+            std::unique_ptr<SampleBuffer> created(new SampleBuffer());
+            if (!slot.compare_exchange_strong(buffer, created.get(), std::memory_order_acq_rel, memory_order_acquire))
+                return buffer; // Allocated by another thread of the same shard
+            return created.release();
+        }
+
         ISummary& observe(double value) override {
-            unique_lock<mutex> lock(m_mutex);
-            m_accumulator(value);
+            auto buffer = localBuffer();
+            while (!buffer->push(value)) {
+                unique_lock<mutex> lock(m_mutex);
+                drain();
+            }
+            m_modified.touch();
+            return *this;
+        }
+
+        ISummary& observeMany(const double* values, size_t count) override {
+            {
+                unique_lock<mutex> lock(m_mutex);
+                drain(values, count);
+            }
+            m_modified.touch();
             return *this;
         }
 
         vector<pair<double, uint64_t>> values() const override
         {
             unique_lock<mutex> lock(m_mutex);
+            drain();
             vector<pair<double, uint64_t>> result;
             for (auto q : m_quantiles) {
-                result.emplace_back(q, boost::accumulators::quantile(m_accumulator, quantile_probability = q));
+                result.emplace_back(q, m_streams[m_head].query(q));
             }
             return result;
         };
 
         uint64_t count() const override {
             unique_lock<mutex> lock(m_mutex);
-            return boost::accumulators::count(m_accumulator);
+            drain();
+            return m_count;
         };
 
         double sum() const override {
             unique_lock<mutex> lock(m_mutex);
-            return boost::accumulators::sum(m_accumulator);;
+            drain();
+            return m_sum;
         };
+
+        ModificationStamp* modificationStamp() override { return &m_modified; }
     };
 
-    std::shared_ptr<ISummary> makeSummary(const vector<double>& quantiles, double error) { 
+    std::shared_ptr<ISummary> makeSummary(const vector<double>& quantiles, double error) {
         // Explicit copy
         auto q = quantiles;
         sort(q.begin(), q.end());
-        return std::make_shared<SummaryImpl>(q, error);
+        return std::make_shared<SummaryImpl>(q, error, steady_clock::duration::zero(), 1);
+    };
+
+    std::shared_ptr<ISummary> makeSummary(const vector<double>& quantiles, double error, steady_clock::duration maxAge, size_t ageBuckets) {
+        if (ageBuckets == 0 || maxAge / ageBuckets <= steady_clock::duration::zero())
+            throw logic_error("Summary window must be positive and have at least one age bucket");
+        auto q = quantiles;
+        sort(q.begin(), q.end());
+        return std::make_shared<SummaryImpl>(q, error, maxAge, ageBuckets);
     };
 }
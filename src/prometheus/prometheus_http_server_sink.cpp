@@ -114,6 +114,7 @@ namespace Metrics {
             {
                 if (request_.target() == "/metrics") {
                     response_.set(http::field::content_type, "text/plain");
+                    context_.registry->expire();
                     beast::ostream(response_.body()) << serialize(context_.registry);
                 }
                 else {
@@ -1,6 +1,8 @@
 #include <metrics/prometheus.h>
 #include <metrics/sink.h>
 
+#include "common/collect.h"
+
 #include <iostream>
 #include <limits>
 #include <sstream>
@@ -21,6 +23,7 @@ namespace Metrics {
                 return "summary";
                 break;
             case TypeCode::Histogram:
+            case TypeCode::ExponentialHistogram:
                 return "histogram";
                 break;
             default:
@@ -29,39 +32,58 @@ namespace Metrics {
             return "unknown";
         }
 
-        ostream& operator<<(ostream& os, const Labels& labels)
+        // Constant labels of a group which are not shadowed by labels of a series, followed by labels of the series
+        struct SeriesLabels {
+            LabelRange constant;
+            LabelRange own;
+
+            bool empty() const { return constant.empty() && own.empty(); }
+
+            // Writes labels, each followed by a comma
+            void list(ostream& os) const
+            {
+                for (const auto& label : constant)
+                    if (!own.contains(*label.name))
+                        os << *label.name << "=\"" << *label.value << '"' << ',';
+                for (const auto& label : own)
+                    os << *label.name << "=\"" << *label.value << '"' << ',';
+            }
+        };
+
+        ostream& operator<<(ostream& os, const SeriesLabels& labels)
         {
+            if (labels.empty())
+                return os;
             bool opened = false;
-            for (auto kv = labels.cbegin(); kv != labels.cend(); kv++) {
-                os << (opened ? "," : "{") << kv->first << "=\"" << kv->second << '"';
-                opened = true;
+            for (const LabelRange* range : { &labels.constant, &labels.own }) {
+                for (const auto& label : *range) {
+                    if (range == &labels.constant && labels.own.contains(*label.name))
+                        continue;
+                    os << (opened ? "," : "{") << *label.name << "=\"" << *label.value << '"';
+                    opened = true;
+                }
             }
-            if (opened)
-                os << '}';
+            os << '}';
             return os;
         }
 
-        void serialize(ostream& os, const string& name, const Labels& labels, const ISummary& summary)
+        void serialize(ostream& os, const string& name, const SeriesLabels& labels, const ISummary& summary)
         {
             for (auto& value : summary.values()) {
                 os << name << '{';
-                for (auto kv = labels.cbegin(); kv != labels.cend(); kv++) {
-                    os << kv->first << "=\"" << kv->second << '"' << ',';
-                }
+                labels.list(os);
                 os << "quantile=\"" << value.first << "\"} " << value.second << endl;
             }
             os << name << "_sum" << labels << ' ' << summary.sum() << endl;
             os << name << "_count" << labels << ' ' << summary.count() << endl;
         }
 
-        void serialize(ostream& os, const string& name, const Labels& labels, const IHistogram& histogram)
+        void serialize(ostream& os, const string& name, const SeriesLabels& labels, const IHistogram& histogram)
         {
             uint64_t count = 0;
             for (auto& value : histogram.values()) {
                 os << name << '{';
-                for (auto kv = labels.cbegin(); kv != labels.cend(); kv++) {
-                    os << kv->first << "=\"" << kv->second << '"' << ',';
-                }
+                labels.list(os);
                 os << "le=\"" << value.first << "\"} " << value.second << endl;
 
                 if (value.first == numeric_limits<double>::infinity())
@@ -71,18 +93,40 @@ namespace Metrics {
             os << name << "_count" << labels << ' ' << count << endl;
         }
 
-        void serialize(ostream& os, const string& name, const Labels& labels, const std::shared_ptr<IMetric> metric)
+        // Text format has no native representation of exponential buckets, so they are exposed as
+        // classic cumulative buckets: negative buckets, zero bucket, then positive buckets
+        void serialize(ostream& os, const string& name, const SeriesLabels& labels, const IExponentialHistogram& histogram)
         {
-            if (!metric)
-                return;
+            auto buckets = histogram.values();
+            auto bucket = [&](double bound, uint64_t count) {
+                os << name << '{';
+                labels.list(os);
+                os << "le=\"" << bound << "\"} " << count << endl;
+            };
+
+            uint64_t count = 0;
+            for (auto it = buckets.negative.crbegin(); it != buckets.negative.crend(); it++)
+                bucket(-ExponentialBuckets::lowerBound(buckets.scale, it->first), count += it->second);
+            if (buckets.zeroCount != 0)
+                bucket(buckets.zeroThreshold, count += buckets.zeroCount);
+            for (auto it = buckets.positive.cbegin(); it != buckets.positive.cend(); it++)
+                bucket(ExponentialBuckets::lowerBound(buckets.scale, it->first + 1), count += it->second);
+            bucket(numeric_limits<double>::infinity(), count);
+
+            os << name << "_sum" << labels << ' ' << histogram.sum() << endl;
+            os << name << "_count" << labels << ' ' << count << endl;
+        }
+
+        void serialize(ostream& os, const string& name, const RegistrySnapshot& snapshot, const RegistrySnapshot::Group& group, size_t series)
+        {
+            const auto& metric = snapshot.metric(series);
+            const SeriesLabels labels = { group.labels(), snapshot.labels(series) };
             switch (metric->type()) {
             case TypeCode::Counter:
-                // os << "# TYPE " << name << " counter" << endl;
-                os << name << labels << ' ' << static_pointer_cast<ICounterValue>(metric)->value() << endl;
+                os << name << labels << ' ' << snapshot.counter(series) << endl;
                 break;
             case TypeCode::Gauge:
-                // os << "# TYPE " << name << " gauge" << endl;
-                os << name << labels << ' ' << static_pointer_cast<IGaugeValue>(metric)->value() << endl;
+                os << name << labels << ' ' << snapshot.gauge(series) << endl;
                 break;
             case TypeCode::Summary:
                 serialize(os, name, labels, *static_pointer_cast<ISummary>(metric));
@@ -90,26 +134,34 @@ namespace Metrics {
             case TypeCode::Histogram:
                 serialize(os, name, labels, *static_pointer_cast<IHistogram>(metric));
                 break;
+            case TypeCode::ExponentialHistogram:
+                serialize(os, name, labels, *static_pointer_cast<IExponentialHistogram>(metric));
+                break;
             }
         }
 
-        string serialize(std::shared_ptr<IRegistry> registry)
+        string serialize(const RegistrySnapshot& snapshot)
         {
             stringstream out;
-            auto names = registry->metricNames();
-            for (const auto& name : names) {
-                auto& group = registry->getGroup(name);
-                if (!group.description().empty())
-                    out << "# HELP " << name << " " << group.description() << endl;
-                out << "# TYPE " << name << " " << typeString(group.type()) << endl;
-                auto metrics = group.metrics();
-                for (const auto& metric : metrics)
-                    serialize(out, name, metric.first, metric.second);
+            string name;
+            for (size_t i = 0; i < snapshot.groupCount(); i++) {
+                const auto& group = snapshot.group(i);
+                name.assign(group.prefix ? *group.prefix : string()).append(*group.name);
+                // Groups with same name from different registries of a composite share one header
+                if (i == 0 || snapshot.group(i - 1).compare(group) != 0) {
+                    if (group.description)
+                        out << "# HELP " << name << " " << *group.description << endl;
+                    out << "# TYPE " << name << " " << typeString(group.type) << endl;
+                }
+                for (size_t series = group.begin; series < group.end; series++)
+                    serialize(out, name, snapshot, group, series);
             }
             return out.str();
         }
 
-
-
+        string serialize(std::shared_ptr<IRegistry> registry)
+        {
+            return serialize(*CollectedSnapshot(*registry));
+        }
     }
 }
@@ -1,6 +1,8 @@
 #include <metrics/statsd.h>
 #include <metrics/sink.h>
 
+#include "common/collect.h"
+
 #pragma warning(push, 1)
 #include <boost/asio.hpp>
 #pragma warning(pop)
@@ -16,11 +18,16 @@ using asio::ip::tcp;
 
 namespace Metrics {
     namespace Statsd {
-        void write(ostream& os, const string& name, const Labels& labels)
+        void write(ostream& os, const RegistrySnapshot::Group& group, const LabelRange& labels)
         {
-            os << name;
-            for (auto kv = labels.cbegin(); kv != labels.cend(); kv++)
-                os << "," << kv->first << "=" << kv->second;
+            if (group.prefix)
+                os << *group.prefix;
+            os << *group.name;
+            for (const auto& label : group.labels())
+                if (!labels.contains(*label.name))
+                    os << "," << *label.name << "=" << *label.value;
+            for (const auto& label : labels)
+                os << "," << *label.name << "=" << *label.value;
         }
 
         struct StatsdSerializer
@@ -31,25 +38,25 @@ namespace Metrics {
                 return os.str();
             }
 
-            void serialize(std::shared_ptr<IRegistry> registry)
+            // Serializes series changed after collection generation since, which is then advanced
+            void serialize(std::shared_ptr<IRegistry> registry, uint64_t& since)
             {
-                auto names = registry->metricNames();
-                for (const auto& name : names)
+                const CollectedSnapshot collected(*registry, since);
+                const RegistrySnapshot& snapshot = *collected;
+                since = snapshot.generation();
+                for (size_t i = 0; i < snapshot.groupCount(); i++)
                 {
-                    auto& group = registry->getGroup(name);
-                    auto metrics = group.metrics();
-                    for (const auto& kv : metrics) {
-                        const auto& labels = kv.first;
-                        const auto& metric = kv.second;
-                        switch (metric->type())
+                    const auto& group = snapshot.group(i);
+                    for (size_t series = group.begin; series < group.end; series++) {
+                        switch (group.type)
                         {
                         case TypeCode::Counter:
-                            write(os, name, labels);
-                            os << "|" << static_pointer_cast<ICounterValue>(metric)->value() << "|c" << endl;
+                            write(os, group, snapshot.labels(series));
+                            os << "|" << snapshot.counter(series) << "|c" << endl;
                             break;
                         case TypeCode::Gauge:
-                            write(os, name, labels);
-                            os << "|" << static_pointer_cast<IGaugeValue>(metric)->value() << "|g" << endl;
+                            write(os, group, snapshot.labels(series));
+                            os << "|" << snapshot.gauge(series) << "|g" << endl;
                             break;
                         default:
                             break;
@@ -60,9 +67,15 @@ namespace Metrics {
         };
 
         string serialize(std::shared_ptr<IRegistry> registry)
+        {
+            uint64_t since = 0;
+            return serialize(registry, since);
+        }
+
+        string serialize(std::shared_ptr<IRegistry> registry, uint64_t& since)
         {
             StatsdSerializer s;
-            s.serialize(registry);
+            s.serialize(registry, since);
             return s.str();
         }
 
@@ -96,6 +109,7 @@ namespace Metrics {
                 };
 
                 // Serialize input into string
+                registry->expire();
                 auto data = serialize(registry);
 
                 // Send 
@@ -153,6 +167,7 @@ namespace Metrics {
             void send(shared_ptr<IRegistry> registry) override
             {
                 // Serialize input into string
+                registry->expire();
                 auto data = serialize(registry);
 
                 // Prepare network structures
@@ -67,6 +67,22 @@ summary2_count{summary="label"} 3
 )"));
 }
 
+TEST_CASE("Serialize.PrometheusExponentialHistogram", "[prometheus]")
+{
+    auto registry = createRegistry();
+    registry->getExponentialHistogram("histogram", { { "label", "value" } }, 0).observe(3).observe(0).observe(-1.5);
+    auto result = Metrics::Prometheus::serialize(registry);
+
+    CHECK_THAT(result, Equals(R"(# TYPE histogram histogram
+histogram{label="value",le="-1"} 1
+histogram{label="value",le="0"} 2
+histogram{label="value",le="4"} 3
+histogram{label="value",le="inf"} 3
+histogram_sum{label="value"} 1.5
+histogram_count{label="value"} 3
+)"));
+}
+
 TEST_CASE("Serialize.Json", "[json]")
 {
     auto registry = createReferenceRegistry();
@@ -75,6 +91,15 @@ TEST_CASE("Serialize.Json", "[json]")
     CHECK_THAT(result, Equals(R"([{"name":"counter1","type":"counter","value":1},{"name":"counter2","labels":{"label":"value1"},"type":"counter","value":1},{"name":"counter2","labels":{"label":"value2"},"type":"counter","value":2},{"name":"gauge1","type":"gauge","value":1E2},{"name":"gauge2","labels":{"another":"label"},"type":"gauge","value":2E2},{"name":"histogram1","type":"histogram","sum":3E0,"count":2,"buckets":[{"bound":1E0,"count":1},{"bound":2E0,"count":2},{"bound":5E0,"count":2},{"bound":1e99999,"count":2}]},{"name":"histogram2","labels":{"more":"labels"},"type":"histogram","sum":7E0,"count":2,"buckets":[{"bound":1E0,"count":0},{"bound":2E0,"count":0},{"bound":5E0,"count":2},{"bound":1e99999,"count":2}]},{"name":"summary1","type":"summary","count":3,"sum":6E0,"quantiles":[{"quantile":5E-1,"count":2},{"quantile":9E-1,"count":3},{"quantile":9.9E-1,"count":3},{"quantile":9.99E-1,"count":3}]},{"name":"summary2","labels":{"summary":"label"},"type":"summary","count":3,"sum":1.1E1,"quantiles":[{"quantile":5E-1,"count":3},{"quantile":9E-1,"count":5},{"quantile":9.9E-1,"count":5},{"quantile":9.99E-1,"count":5}]}])"));
 }
 
+TEST_CASE("Serialize.JsonView", "[json]")
+{
+    auto registry = createRegistry();
+    registry->getCounter("requests", { { "service", "search" } })++;
+    auto result = Metrics::Json::serializeJson(createRegistryView(registry, "", { { "service", "billing" }, { "zone", "eu" } }));
+
+    CHECK_THAT(result, Equals(R"([{"name":"requests","labels":{"zone":"eu","service":"search"},"type":"counter","value":1}])"));
+}
+
 TEST_CASE("Serialize.Jsonl", "[jsonl]")
 {
     auto registry = createReferenceRegistry();
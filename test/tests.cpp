@@ -4,6 +4,8 @@
 #include <metrics/timer.h>
 #include <metrics/sink.h>
 #include <metrics/prometheus.h>
+#include <metrics/local.h>
+#include <metrics/static_histogram.h>
 
 #include <catch2/catch_test_macros.hpp>
 #include <catch2/matchers/catch_matchers_string.hpp>
@@ -11,6 +13,10 @@
 
 #include "common.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
 #include <map>
 #include <thread>
 #include <chrono>
@@ -62,6 +68,108 @@ TEST_CASE("Metric.Counter", "[metric][counter]")
     CHECK(counter4 == 0);
 }
 
+TEST_CASE("Metric.CounterValue", "[metric][counter]")
+{
+    auto value = std::make_shared<CounterValue>(5);
+    Counter counter(value);
+    counter++;
+    counter += 2;
+    CHECK(value->value() == 8);
+
+    auto gaugeValue = std::make_shared<GaugeValue>();
+    Gauge gauge(gaugeValue);
+    gauge = 3;
+    gauge -= 1;
+    CHECK(gaugeValue->value() == 2);
+}
+
+TEST_CASE("Registry.MetricRefs", "[registry]")
+{
+    auto registry = createRegistry();
+    auto counter = registry->getCounterRef("counter", { { "a", "b" } });
+    auto copy = counter;
+    copy++;
+    counter += 2;
+    CHECK(registry->getCounter("counter", { { "a", "b" } }).value() == 3);
+
+    auto sharded = registry->getCounterRef("sharded", {}, Sharding::PerThread);
+    sharded++;
+    CHECK(registry->getCounter("sharded").value() == 1);
+
+    auto gauge = registry->getGaugeRef("gauge");
+    gauge = 5;
+    gauge += 1;
+    CHECK(registry->getGauge("gauge").value() == 6);
+    CHECK_THROWS_AS(registry->getGaugeRef("counter"), logic_error);
+}
+
+TEST_CASE("Metric.ShardedCounter", "[metric][counter]")
+{
+    Counter counter(Sharding::PerThread);
+    CHECK(counter == 0);
+    counter++;
+    counter += 9;
+    CHECK(counter == 10);
+
+    vector<thread> threads;
+    for (int t = 0; t < 4; t++)
+        threads.emplace_back([counter]() mutable {
+            for (int i = 0; i < 1000; i++)
+                counter++;
+        });
+    for (auto& t : threads)
+        t.join();
+    CHECK(counter == 4010);
+
+    counter.reset();
+    CHECK(counter == 0);
+
+    auto registry = createRegistry();
+    registry->getCounter("sharded", {}, Sharding::PerThread) += 5;
+    CHECK(registry->getCounter("sharded") == 5);
+}
+
+TEST_CASE("Metric.LocalCounter", "[metric][counter]")
+{
+    auto registry = createRegistry();
+    auto counter = registry->getCounter("packets");
+
+    vector<thread> threads;
+    for (int t = 0; t < 4; t++)
+        threads.emplace_back([counter]() {
+            static thread_local LocalCounter local(counter, 100);
+            for (int i = 0; i < 1050; i++)
+                local++;
+        });
+    for (auto& t : threads)
+        t.join();
+    CHECK(counter.value() == 4200); // Flushed on thread exit
+
+    LocalCounter local(counter, 1000, std::chrono::hours(1));
+    local += 5;
+    CHECK(counter.value() == 4200);
+    CHECK(local.value() == 4205);
+    CHECK_THAT(Prometheus::serialize(registry), Equals("# TYPE packets counter\npackets 4205\n"));
+    CHECK_THROWS_AS(LocalCounter(counter, 0), logic_error);
+}
+
+TEST_CASE("Metric.LocalHistogram", "[metric][histogram]")
+{
+    Histogram histogram({ 1., 2., 5. });
+    {
+        LocalHistogram local(histogram, 4);
+        for (auto v : { 0.5, 1.5, 2.5, 3.5, 7.5, 0.5 })
+            local.observe(v);
+        CHECK(histogram.count() >= 4);
+        flushLocalMetrics();
+        CHECK(histogram.count() == 6);
+        local.observe(3);
+    }
+    CHECK(histogram.count() == 7);
+    CHECK(histogram.sum() == 19);
+    CHECK(histogram.values()[2].second == 6);
+}
+
 TEST_CASE("Metric.Gauge", "[metric][gauge]")
 {
     Gauge gauge;
@@ -83,6 +191,50 @@ TEST_CASE("Metric.Gauge", "[metric][gauge]")
     CHECK(gauge == 3.0);
 }
 
+TEST_CASE("Metric.UpDownGauge", "[metric][gauge]")
+{
+    auto registry = createRegistry();
+    for (auto sharding : { Sharding::None, Sharding::PerThread }) {
+        auto gauge = registry->getGauge("in_flight", { { "sharded", sharding == Sharding::None ? "0" : "1" } }, GaugeKind::UpDown, sharding);
+
+        vector<thread> threads;
+        for (int t = 0; t < 4; t++)
+            threads.emplace_back([gauge]() mutable {
+                for (int i = 0; i < 1000; i++) {
+                    gauge += 1;
+                    gauge += 0.5;
+                    gauge -= 1;
+                }
+            });
+        for (auto& t : threads)
+            t.join();
+
+        CHECK(gauge.value() == 2000);
+        gauge = 2.25;
+        CHECK(gauge.value() == 2.25);
+        gauge -= 3;
+        CHECK(gauge.value() == -0.75);
+
+        // Concurrent assignments of the same value must not add up
+        threads.clear();
+        for (int t = 0; t < 4; t++)
+            threads.emplace_back([gauge]() mutable {
+                for (int i = 0; i < 1000; i++)
+                    gauge = 5;
+            });
+        for (auto& t : threads)
+            t.join();
+        CHECK(gauge.value() == 5);
+
+        gauge = numeric_limits<double>::quiet_NaN();
+        CHECK(gauge.value() == 0);
+        gauge = 1e300;
+        CHECK(gauge.value() > 9e12);
+        gauge = -1e300;
+        CHECK(gauge.value() < -9e12);
+    }
+}
+
 TEST_CASE("Metric.Histogram", "[metric][histogram]")
 {
     Histogram histogram({ 1., 2., 5. });
@@ -104,6 +256,257 @@ TEST_CASE("Metric.Histogram", "[metric][histogram]")
     CHECK(values[2].second == 3);
 }
 
+TEST_CASE("Metric.HistogramBucketSearch", "[metric][histogram]")
+{
+    // Bucket selection must match std::lower_bound for any bucket count, including vector tails
+    for (size_t nBuckets : { 1, 2, 3, 4, 5, 7, 8, 9, 31, 64, 100 }) {
+        DYNAMIC_SECTION("buckets=" << nBuckets) {
+            vector<double> bounds;
+            for (size_t i = 0; i < nBuckets; i++)
+                bounds.push_back(i * 1.5 - 10.);
+
+            vector<double> samples = { -numeric_limits<double>::infinity(), -100., numeric_limits<double>::infinity(), 1e9 };
+            for (double b : bounds) {
+                samples.push_back(b);
+                samples.push_back(b - 0.25);
+                samples.push_back(b + 0.25);
+            }
+
+            Histogram histogram(bounds);
+            vector<uint64_t> expected(nBuckets + 1);
+            bounds.push_back(numeric_limits<double>::infinity());
+            for (double s : samples) {
+                histogram.observe(s);
+                expected[lower_bound(bounds.begin(), bounds.end(), s) - bounds.begin()]++;
+            }
+
+            auto values = histogram.values();
+            REQUIRE(values.size() == expected.size());
+            uint64_t total = 0;
+            for (size_t i = 0; i < values.size(); i++) {
+                total += expected[i];
+                CHECK(values[i].first == bounds[i]);
+                CHECK(values[i].second == total);
+            }
+        }
+    }
+}
+
+TEST_CASE("Metric.HistogramBuckets", "[metric][histogram]")
+{
+    auto linear = makeLinearBuckets(-1., 0.1, 50);
+    auto exponential = makeExponentialBuckets(0.001, 1.5, 40);
+
+    CHECK(linear->bounds().size() == 51);
+    CHECK(linear->bounds()[1] == Catch::Approx(-0.9));
+    CHECK(exponential->bounds().size() == 41);
+    CHECK(exponential->bounds()[2] == Catch::Approx(0.00225));
+    CHECK(exponential->bounds().back() == numeric_limits<double>::infinity());
+
+    // Arithmetic bucket index must match a search over bounds, including values exactly on bounds
+    for (auto buckets : { linear, exponential }) {
+        const auto& bounds = buckets->bounds();
+        vector<double> samples = { -1e9, 0., 1e9, numeric_limits<double>::infinity(), -numeric_limits<double>::infinity() };
+        for (double b : bounds) {
+            samples.push_back(b);
+            samples.push_back(nextafter(b, -numeric_limits<double>::infinity()));
+            samples.push_back(nextafter(b, numeric_limits<double>::infinity()));
+            samples.push_back(b * 1.01);
+        }
+        for (double s : samples)
+            CHECK(buckets->bucket(s) == (size_t)(lower_bound(bounds.begin(), bounds.end(), s) - bounds.begin()));
+    }
+
+    CHECK_THROWS(makeLinearBuckets(0., 0., 10));
+    CHECK_THROWS(makeExponentialBuckets(0., 2., 10));
+    CHECK_THROWS(makeExponentialBuckets(1., 1., 10));
+
+    auto registry = createRegistry();
+    registry->getHistogram("latency", { { "path", "a" } }, exponential).observe(0.001).observe(0.0015);
+    registry->getHistogram("latency", { { "path", "b" } }, exponential).observe(0.002);
+    auto values = registry->getHistogram("latency", { { "path", "a" } }).values();
+    CHECK(values.size() == 41);
+    CHECK(values[0].second == 1);
+    CHECK(values[1].second == 2);
+    CHECK(registry->getHistogram("latency", { { "path", "b" } }).count() == 1);
+}
+
+TEST_CASE("Metric.ShardedHistogram", "[metric][histogram]")
+{
+    Histogram histogram({ 1., 2., 5. }, Sharding::PerThread);
+
+    vector<thread> threads;
+    for (int t = 0; t < 4; t++)
+        threads.emplace_back([histogram]() mutable {
+            for (int i = 0; i < 100; i++)
+                histogram.observe(1).observe(2).observe(3).observe(7);
+        });
+    for (auto& t : threads)
+        t.join();
+
+    auto values = histogram.values();
+
+    CHECK(histogram.sum() == 5200);
+    CHECK(histogram.count() == 1600);
+    CHECK(values.size() == 4);
+    CHECK(values[0].second == 400);
+    CHECK(values[1].second == 800);
+    CHECK(values[2].second == 1200);
+    CHECK(values[3].second == 1600);
+}
+
+TEST_CASE("Metric.StaticHistogram", "[metric][histogram]")
+{
+    StaticHistogram<std::ratio<1>, 1, 2, 5> histogram;
+    Histogram reference({ 1., 2., 5. });
+    for (auto v : { 0., 1., 1.5, 2., 3., 5., 7., -1. }) {
+        histogram.observe(v);
+        reference.observe(v);
+    }
+
+    CHECK(histogram.values() == reference.values());
+    CHECK(histogram.count() == 8);
+    CHECK(histogram.sum() == 18.5);
+
+    StaticHistogram<std::milli, 1, 10> latency;
+    auto registry = createRegistry();
+    registry->add(latency, "latency");
+    latency.observe(0.005);
+    CHECK(registry->getHistogram("latency").values() == vector<pair<double, uint64_t>>{ { 0.001, 0 }, { 0.01, 1 }, { numeric_limits<double>::infinity(), 1 } });
+}
+
+TEST_CASE("Metric.IntegerHistogram", "[metric][histogram]")
+{
+    auto histogram = createRegistry()->getIntegerHistogram("latency", {}, { 5000000, 1000000, 2000000 }, 1e-9);
+    histogram.observe(999999).observe(1000000).observe(1000001).observe(7000000).observe(-5);
+
+    auto values = histogram.values();
+    CHECK(histogram.count() == 5);
+    CHECK(histogram.sum() == Catch::Approx(0.010000000));
+    REQUIRE(values.size() == 4);
+    CHECK(values[0] == pair<double, uint64_t>{ 1000000 * 1e-9, 3 });
+    CHECK(values[1] == pair<double, uint64_t>{ 2000000 * 1e-9, 4 });
+    CHECK(values[2] == pair<double, uint64_t>{ 5000000 * 1e-9, 4 });
+    CHECK(values[3] == pair<double, uint64_t>{ numeric_limits<double>::infinity(), 5 });
+    CHECK_THROWS_AS(makeIntegerHistogram({ 1 }, 0.), logic_error);
+
+    // Integer observations are not rounded through double
+    const uint64_t large = 1ull << 53;
+    Histogram exact(makeIntegerHistogram({ large }));
+    exact.observeInteger(large + 1);
+    exact.observe((double)(large + 1));
+    CHECK(exact.values()[0].second == 1);
+}
+
+TEST_CASE("Metric.ObserveMany", "[metric][histogram][summary]")
+{
+    const vector<double> batch = { 0.5, 1, 1.5, 3, 4, 10, 0.1, 2 };
+
+    auto check = [&](IHistogram& many, IHistogram& single) {
+        many.observeMany(batch.data(), batch.size());
+        for (auto v : batch)
+            single.observe(v);
+        CHECK(many.values() == single.values());
+        CHECK(many.count() == single.count());
+        CHECK(many.sum() == Catch::Approx(single.sum()));
+    };
+
+    Histogram h1({ 1., 2., 5. }), h2({ 1., 2., 5. });
+    check(h1, h2);
+    Histogram s1({ 1., 2., 5. }, Sharding::PerThread), s2({ 1., 2., 5. }, Sharding::PerThread);
+    check(s1, s2);
+    Histogram i1(makeIntegerHistogram({ 1, 2, 5 })), i2(makeIntegerHistogram({ 1, 2, 5 }));
+    check(i1, i2);
+
+    Summary summary({ .5, .99 });
+    summary.observe(7).observeMany(batch.data(), batch.size());
+    CHECK(summary.count() == 9);
+    CHECK(summary.sum() == Catch::Approx(29.1));
+    CHECK(summary.values() == vector<pair<double, uint64_t>>{ { .5, 2 }, { .99, 10 } });
+
+    // Longer than one chunk of batched counter updates
+    vector<double> latencies;
+    for (int i = 0; i < 1000; i++)
+        latencies.push_back((i * 37) % 500);
+    auto hdrMany = makeHdrSummary({ .5, .9, .99 }, 1000, 2), hdrSingle = makeHdrSummary({ .5, .9, .99 }, 1000, 2);
+    hdrMany->observeMany(latencies.data(), latencies.size());
+    for (auto v : latencies)
+        hdrSingle->observe(v);
+    CHECK(hdrMany->count() == 1000);
+    CHECK(hdrMany->sum() == hdrSingle->sum());
+    CHECK(hdrMany->values() == hdrSingle->values());
+}
+
+TEST_CASE("Metric.ExponentialHistogram", "[metric][histogram]")
+{
+    using Buckets = vector<pair<int32_t, uint64_t>>;
+
+    SECTION("Buckets")
+    {
+        ExponentialHistogram histogram(0);
+        histogram.observe(1).observe(2).observe(3).observe(4).observe(0).observe(-1.5);
+
+        auto values = histogram.values();
+        CHECK(histogram.count() == 6);
+        CHECK(histogram.sum() == 8.5);
+        CHECK(values.scale == 0);
+        CHECK(values.zeroCount == 1);
+        CHECK(values.positive == Buckets{ { -1, 1 }, { 0, 1 }, { 1, 2 } });
+        CHECK(values.negative == Buckets{ { 0, 1 } });
+        CHECK(ExponentialBuckets::lowerBound(0, 1) == 2);
+        CHECK(ExponentialBuckets::lowerBound(2, 3) == Catch::Approx(pow(2., .75)));
+    }
+
+    SECTION("Downscale")
+    {
+        ExponentialHistogram histogram(3, 4);
+        histogram.observe(1).observe(1000);
+
+        auto values = histogram.values();
+        CHECK(values.scale == -2);
+        CHECK(values.positive == Buckets{ { -1, 1 }, { 2, 1 } });
+        CHECK_THROWS_AS(ExponentialHistogram(3, 3), logic_error);
+    }
+
+    SECTION("Growth")
+    {
+        // Windows grow up to maxBuckets before scale is reduced
+        ExponentialHistogram histogram(3, 160);
+        for (int i = 0; i <= 15; i++)
+            histogram.observe(ldexp(1.5, i)).observe(-ldexp(1.5, -i));
+
+        auto values = histogram.values();
+        CHECK(values.scale == 3);
+        CHECK(values.positive.size() == 16);
+        CHECK(values.negative.size() == 16);
+        CHECK(values.positive.back().first - values.positive.front().first == 120);
+    }
+
+    SECTION("Concurrent")
+    {
+        auto histogram = createRegistry()->getExponentialHistogram("latency", {}, 20, 16);
+
+        vector<thread> threads;
+        for (int t = 0; t < 4; t++)
+            threads.emplace_back([histogram, t]() mutable {
+                for (int i = 1; i <= 1000; i++)
+                    histogram.observe(i * (t + 1));
+            });
+        for (auto& t : threads)
+            t.join();
+
+        auto values = histogram.values();
+        uint64_t total = 0;
+        for (const auto& bucket : values.positive) {
+            CHECK(ExponentialBuckets::lowerBound(values.scale, bucket.first) < 4000);
+            total += bucket.second;
+        }
+        CHECK(values.positive.size() <= 16);
+        CHECK(total == 4000);
+        CHECK(histogram.count() == 4000);
+    }
+}
+
 TEST_CASE("Metric.Summary", "[metric][summary]")
 {
     const vector<double> expected_quantiles = { .5, .75, .99 };
@@ -128,6 +531,70 @@ TEST_CASE("Metric.Summary", "[metric][summary]")
     CHECK(actual_values == expected_values);
 }
 
+TEST_CASE("Metric.SummaryError", "[metric][summary]")
+{
+    const vector<double> quantiles = { .5, .9, .99 };
+    Summary summary(quantiles, 0.01);
+
+    // Shuffled 1..10000 - quantile q must be within error*n ranks of q*n
+    vector<thread> threads;
+    for (int t = 0; t < 4; t++)
+        threads.emplace_back([summary, t]() mutable {
+            for (int i = 0; i < 2500; i++)
+                summary.observe((i * 7919 + t * 2500 * 7919) % 10000 + 1);
+        });
+    for (auto& t : threads)
+        t.join();
+
+    CHECK(summary.count() == 10000);
+    CHECK(summary.sum() == 50005000);
+    for (auto v : summary.values())
+        CHECK(abs((double)v.second - v.first * 10000) <= 0.01 * 10000);
+    CHECK(Summary(quantiles).values() == vector<pair<double, uint64_t>>{ { .5, 0 }, { .9, 0 }, { .99, 0 } });
+}
+
+TEST_CASE("Metric.WindowedSummary", "[metric][summary]")
+{
+    const vector<double> quantiles = { .5, .99 };
+    auto summary = createRegistry()->getSummary("latency", {}, quantiles, 0.01, 100ms, 2);
+
+    for (int i = 0; i < 10; i++)
+        summary.observe(100);
+    CHECK(summary.values() == vector<pair<double, uint64_t>>{ { .5, 100 }, { .99, 100 } });
+
+    sleep_for(120ms);
+    summary.observe(1);
+    CHECK(summary.values() == vector<pair<double, uint64_t>>{ { .5, 1 }, { .99, 1 } });
+    CHECK(summary.count() == 11);
+    CHECK(summary.sum() == 1001);
+    CHECK_THROWS_AS(Summary(quantiles, 0.01, 0ms), logic_error);
+}
+
+TEST_CASE("Metric.HdrSummary", "[metric][summary]")
+{
+    auto summary = createRegistry()->getHdrSummary("latency", {}, { .5, .9, .99, 1. }, 1000000, 2);
+
+    vector<thread> threads;
+    for (int t = 0; t < 4; t++)
+        threads.emplace_back([summary, t]() mutable {
+            for (int i = 1; i <= 2500; i++)
+                summary.observe(t * 2500 + i);
+        });
+    for (auto& t : threads)
+        t.join();
+
+    CHECK(summary.count() == 10000);
+    CHECK(summary.sum() == 50005000);
+    for (auto v : summary.values())
+        CHECK(abs((double)v.second - v.first * 10000) <= 0.01 * v.first * 10000);
+
+    summary.observe(-1).observe(1e9);
+    CHECK(summary.values().front().second < 10000);
+    CHECK(summary.values().back().second == 1000000);
+    CHECK(makeHdrSummary({ .5 })->values().front().second == 0);
+    CHECK_THROWS_AS(makeHdrSummary({ .5 }, 1000, 0), logic_error);
+}
+
 TEST_CASE("Registry.Registry", "[registry]")
 {
     auto registry = createReferenceRegistry();
@@ -149,6 +616,548 @@ TEST_CASE("Registry.Registry", "[registry]")
     CHECK(contains(names, "gauge2"));
 };
 
+TEST_CASE("Registry.GroupMetrics", "[registry]")
+{
+    auto registry = createRegistry();
+    registry->getCounter("requests", Labels{ { "method", "POST" }, { "status", "200" } }) += 2;
+    registry->getCounter("requests", Labels{ { "method", "GET" }, { "status", "200" } })++;
+    registry->getCounter("requests", Labels{ { "method", "GET" } })++;
+    registry->getCounter("requests")++;
+
+    // Series are returned with their labels, ordered as Labels
+    auto metrics = registry->getGroup("requests").metrics();
+    REQUIRE(metrics.size() == 4);
+    CHECK(metrics[0].first == Labels{});
+    CHECK(metrics[1].first == Labels{ { "method", "GET" } });
+    CHECK(metrics[2].first == Labels{ { "method", "GET" }, { "status", "200" } });
+    CHECK(metrics[3].first == Labels{ { "method", "POST" }, { "status", "200" } });
+    CHECK(static_pointer_cast<ICounterValue>(metrics[3].second)->value() == 2);
+}
+
+TEST_CASE("Registry.LabelViews", "[registry]")
+{
+    auto registry = createRegistry();
+
+    auto counter = registry->getCounter("views", Labels{ { "a", "1" }, { "b", "2" } });
+    counter += 3;
+
+    // Views are matched regardless of order; names may be given as std::string
+    CHECK(registry->getCounter("views", { { "b", "2" }, { "a", "1" } }).value() == 3);
+    CHECK(registry->getCounter(string("views"), { { "a", "1" }, { "b", "2" } }).value() == 3);
+
+    // Partial or duplicate labels refer to other series
+    registry->getCounter("views", { { "a", "1" }, { "a", "1" } })++;
+    registry->getCounter("views", { { "a", "1" } })++;
+    CHECK(registry->getCounter("views", Labels{ { "a", "1" } }).value() == 2);
+    CHECK(counter.value() == 3);
+    CHECK(registry->size() == 2);
+
+    registry->getGauge("views_gauge", { { "a", "1" } }) = 5;
+    CHECK(registry->getGauge("views_gauge", Labels{ { "a", "1" } }).value() == 5.);
+    registry->getHistogram("views_histogram", {}, { 1., 2. }).observe(1.5);
+    CHECK(registry->getHistogram("views_histogram").count() == 1);
+
+    CHECK_THROWS_AS(registry->getGauge("views", { { "a", "1" } }), logic_error);
+}
+
+TEST_CASE("Registry.Family", "[registry]")
+{
+    auto registry = createRegistry();
+
+    auto requests = registry->getCounterFamily("requests", { "method", "status" });
+    requests.withLabelValues("GET", "200")++;
+    requests.withLabelValues("GET", string("200")) += 2;
+    requests.withLabelValues("POST", "500")++;
+
+    // Series are regular registry metrics
+    CHECK(registry->getCounter("requests", { { "method", "GET" }, { "status", "200" } }).value() == 3);
+    CHECK(registry->getCounter("requests", { { "status", "500" }, { "method", "POST" } }).value() == 1);
+    CHECK(registry->size() == 2);
+
+    // Families declared separately share series
+    CHECK(registry->getCounterFamily("requests", { "status", "method" }).withLabelValues("200", "GET").value() == 3);
+
+    auto latency = registry->getHistogramFamily("latency", { "method" }, { 1., 2. });
+    latency.withLabelValues("GET").observe(1.5);
+    CHECK(registry->getHistogram("latency", { { "method", "GET" } }).count() == 1);
+
+    CHECK_THROWS_AS(requests.withLabelValues("GET"), logic_error);
+    CHECK_THROWS_AS(registry->getGaugeFamily("requests", { "method" }).withLabelValues("GET"), logic_error);
+    CHECK_THROWS_AS(registry->getCounterFamily("duplicate", { "a", "a" }), logic_error);
+
+    // Family does not keep its registry alive, and refuses to create series once it is destroyed
+    weak_ptr<IRegistry> weak = registry;
+    registry.reset();
+    CHECK(weak.expired());
+    CHECK_THROWS_AS(requests.withLabelValues("GET", "200"), logic_error);
+    CHECK_THROWS_AS(requests.withLabelValues("PUT", "200"), logic_error);
+}
+
+TEST_CASE("Registry.Sharded", "[registry]")
+{
+    RegistryOptions options;
+    options.shards = 8;
+    auto registry = createRegistry(options);
+
+    vector<thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([registry, t]() {
+            for (int i = 0; i < 100; i++)
+                registry->getCounter("metric_" + std::to_string(i), { { "thread", std::to_string(t) } })++;
+        });
+    }
+    for (auto& t : threads)
+        t.join();
+
+    CHECK(registry->size() == 400);
+    auto names = registry->metricNames();
+    REQUIRE(names.size() == 100);
+    CHECK(std::is_sorted(names.begin(), names.end()));
+    CHECK(registry->getGroup("metric_42").metrics().size() == 4);
+    CHECK(registry->getCounter("metric_42", { { "thread", "3" } }).value() == 1);
+    CHECK_THROWS_AS(registry->getGauge("metric_42"), logic_error);
+
+    options.shards = 0;
+    CHECK_THROWS_AS(createRegistry(options), logic_error);
+}
+
+TEST_CASE("Registry.Remove", "[registry]")
+{
+    auto registry = createRegistry();
+    auto counter = registry->getCounter("requests", { { "path", "/a" } });
+    counter += 5;
+    auto ref = registry->getCounterRef("requests", { { "path", "/b" } });
+    ref++;
+    auto family = registry->getCounterFamily("requests", { "path" });
+    CHECK(family.withLabelValues("/a").value() == 5);
+
+    CHECK(registry->remove("requests", { { "path", "/a" } }));
+    CHECK_FALSE(registry->remove("requests", { { "path", "/a" } }));
+    CHECK_FALSE(registry->remove("unknown"));
+    CHECK(registry->size() == 1);
+
+    // Removed metric stays usable by its holders, but registry and family create a new series
+    counter++;
+    CHECK(counter.value() == 6);
+    CHECK(registry->getCounter("requests", { { "path", "/a" } }).value() == 0);
+    CHECK(registry->getCounter("requests", { { "path", "/a" } }).value() == 0);
+    CHECK(family.withLabelValues("/a").value() == 0);
+
+    // Series referenced by handles are not removed, so that handles stay valid
+    CHECK_FALSE(registry->remove("requests", { { "path", "/b" } }));
+    ref++;
+    CHECK(registry->getCounter("requests", { { "path", "/b" } }).value() == 2);
+
+    // Labels of removed series are freed, but stay valid for snapshots taken before
+    registry->getCounter("churn", { { "id", "first" } });
+    RegistrySnapshot snapshot;
+    registry->snapshot(snapshot);
+    CHECK(registry->remove("churn", { { "id", "first" } }));
+    for (int i = 0; i < 100; i++) {
+        registry->getCounter("churn", { { "id", std::to_string(i) } });
+        registry->remove("churn", { { "id", std::to_string(i) } });
+    }
+    REQUIRE(snapshot.groupCount() == 2);
+    const auto& churn = snapshot.group(0);
+    REQUIRE(*churn.name == "churn");
+    REQUIRE(churn.end - churn.begin == 1);
+    CHECK(*snapshot.labels(churn.begin).begin()->value == "first");
+}
+
+TEST_CASE("Registry.Expire", "[registry]")
+{
+    const auto ttl = chrono::milliseconds(200);
+    RegistryOptions options;
+    options.expireAfter = ttl;
+    auto registry = createRegistry(options);
+    registry->getCounter("expire_idle");
+    registry->getGauge("expire_busy");
+    unique_ptr<Counter> held(new Counter(registry->getCounter("expire_held")));
+    auto pinned = registry->getCounterRef("expire_pinned");
+    registry->add(Counter(), "expire_added");
+    CHECK(registry->size() == 5);
+
+    // Idle time does not depend on how often expire is called, e.g. by several sinks
+    for (int i = 0; i < 10; i++)
+        registry->expire();
+    CHECK(registry->size() == 5);
+
+    this_thread::sleep_for(ttl * 6 / 10);
+    registry->getGauge("expire_busy") += 1;
+    registry->expire();
+    CHECK(registry->size() == 5);
+
+    this_thread::sleep_for(ttl * 6 / 10);
+    registry->expire();
+    CHECK(registry->size() == 4);
+    CHECK(registry->getGroup("expire_idle").metrics().empty());
+    CHECK(registry->getGauge("expire_busy").value() == 1);
+
+    // Series which stops changing is removed once idle for expireAfter. Serialization only reads the
+    // registry, expiry is left to sinks
+    this_thread::sleep_for(ttl);
+    Prometheus::serialize(registry);
+    Statsd::serialize(registry);
+    CHECK(registry->size() == 4);
+    registry->expire();
+    CHECK(registry->size() == 3);
+    pinned++;
+    CHECK(pinned.value() == 1);
+
+    // Series held by caller is kept while idle, so that its updates are still reported
+    (*held)++;
+    CHECK(registry->getCounter("expire_held").value() == 1);
+    held.reset();
+    registry->expire();
+    CHECK(registry->size() == 3);
+    this_thread::sleep_for(ttl);
+    registry->expire();
+    CHECK(registry->getGroup("expire_held").metrics().empty());
+
+    // Without expireAfter, collections do not remove series
+    auto persistent = createRegistry();
+    persistent->getCounter("persistent");
+    for (int i = 0; i < 3; i++)
+        persistent->expire();
+    CHECK(persistent->size() == 1);
+}
+
+TEST_CASE("Registry.ConcurrentRemove", "[registry]")
+{
+    RegistryOptions options;
+    options.expireAfter = chrono::steady_clock::duration(1);
+    auto registry = createRegistry(options);
+
+    // Looks up series while other thread removes and expires them
+    atomic<bool> done(false);
+    thread remover([&]() {
+        for (int i = 0; i < 200; i++) {
+            registry->remove("churn", { { "series", std::to_string(i % 10) } });
+            registry->expire();
+        }
+        done = true;
+    });
+    while (!done) {
+        for (int i = 0; i < 10; i++)
+            registry->getCounter("churn", { { "series", std::to_string(i) } })++;
+    }
+    remover.join();
+    CHECK(registry->size() <= 10);
+}
+
+TEST_CASE("Registry.SeriesCaps", "[registry]")
+{
+    RegistryOptions options;
+    options.maxSeries = 5;
+    options.maxSeriesPerGroup = 3;
+    auto registry = createRegistry(options);
+
+    for (int i = 0; i < 10; i++)
+        registry->getCounter("requests", { { "id", std::to_string(i) } })++;
+    auto family = registry->getCounterFamily("requests", { "id" });
+    family.withLabelValues("100")++;
+    family.withLabelValues("1")++;
+
+    // Group holds three series and overflow series
+    CHECK(registry->getGroup("requests").metrics().size() == 4);
+    CHECK(registry->getCounter("requests", { { "id", "1" } }).value() == 2);
+    CHECK(registry->getCounter("requests", { { "overflow", "true" } }).value() == 8);
+    CHECK(registry->getCounter("metrics_rejected_series_total").value() == 8);
+
+    // Registry cap applies across groups
+    registry->getGauge("other_a");
+    registry->getGauge("other_b");
+    registry->getGauge("other_c") = 5;
+    CHECK(registry->getGroup("other_c").metrics().front().first == Labels{ { "overflow", "true" } });
+    CHECK(registry->getGauge("other_c", { { "overflow", "true" } }).value() == 5);
+    CHECK(registry->getCounter("metrics_rejected_series_total").value() == 9);
+
+    // Removal frees space for new series
+    CHECK(registry->remove("requests", { { "id", "0" } }));
+    registry->getCounter("requests", { { "id", "50" } })++;
+    CHECK(registry->getGroup("requests").metrics().size() == 4);
+    CHECK(registry->getCounter("requests", { { "id", "50" } }).value() == 1);
+    CHECK(registry->getCounter("metrics_rejected_series_total").value() == 9);
+
+    // Failed creation does not use up space
+    CHECK(registry->remove("requests", { { "id", "50" } }));
+    for (int i = 0; i < 3; i++)
+        CHECK_THROWS_AS(registry->getIntegerHistogram("invalid", { { "id", std::to_string(i) } }, { 1 }, 0.), std::logic_error);
+    registry->getCounter("requests", { { "id", "51" } })++;
+    CHECK(registry->getCounter("requests", { { "id", "51" } }).value() == 1);
+    CHECK(registry->getCounter("metrics_rejected_series_total").value() == 9);
+
+    // Internal counter does not take a slot of the registry cap
+    options.maxSeries = 1;
+    options.maxSeriesPerGroup = 0;
+    auto single = createRegistry(options);
+    single->getCounter("only", { { "id", "1" } })++;
+    single->getCounter("only", { { "id", "2" } })++;
+    CHECK(single->getCounter("only", { { "id", "1" } }).value() == 1);
+    CHECK(single->getCounter("only", { { "overflow", "true" } }).value() == 1);
+    CHECK(single->getCounter("metrics_rejected_series_total").value() == 1);
+    CHECK(single->remove("only", { { "id", "1" } }));
+    single->getCounter("only", { { "id", "3" } })++;
+    CHECK(single->getCounter("only", { { "id", "3" } }).value() == 1);
+    single->getCounter("only", { { "id", "4" } })++;
+    CHECK(single->getCounter("only", { { "overflow", "true" } }).value() == 2);
+}
+
+TEST_CASE("Registry.Snapshot", "[registry]")
+{
+    RegistryOptions options;
+    options.shards = 4;
+    auto registry = createRegistry(options);
+    registry->getCounter("b_requests", { { "path", "/a" }, { "method", "GET" } }) += 3;
+    registry->getCounter("b_requests", { { "path", "/b" } })++;
+    registry->getGauge("a_temperature") = 36.6;
+    registry->getHistogram("c_latency", {}, { 1., 2. }).observe(1.5);
+    registry->setDescription("a_temperature", "Body temperature");
+
+    RegistrySnapshot snapshot;
+    registry->snapshot(snapshot);
+    REQUIRE(snapshot.groupCount() == 3);
+    CHECK(snapshot.size() == 4);
+
+    const auto& gauges = snapshot.group(0);
+    CHECK(*gauges.name == "a_temperature");
+    CHECK(*gauges.description == "Body temperature");
+    CHECK(gauges.type == TypeCode::Gauge);
+    CHECK(snapshot.gauge(gauges.begin) == 36.6);
+    CHECK(snapshot.labels(gauges.begin).empty());
+
+    const auto& counters = snapshot.group(1);
+    CHECK(*counters.name == "b_requests");
+    CHECK(counters.description == nullptr);
+    REQUIRE(counters.end - counters.begin == 2);
+    auto labels = snapshot.labels(counters.begin);
+    REQUIRE(labels.size() == 2);
+    CHECK(*labels.begin()[0].name == "method");
+    CHECK(*labels.begin()[1].value == "/a");
+    CHECK(snapshot.counter(counters.begin) == 3);
+    CHECK(snapshot.counter(counters.begin + 1) == 1);
+
+    const auto& histograms = snapshot.group(2);
+    CHECK(static_pointer_cast<IHistogram>(snapshot.metric(histograms.begin))->sum() == 1.5);
+
+    // Snapshot is reused by next collection
+    registry->remove("b_requests", { { "path", "/b" } });
+    registry->snapshot(snapshot);
+    CHECK(snapshot.size() == 3);
+    CHECK(Prometheus::serialize(snapshot) == Prometheus::serialize(registry));
+}
+
+TEST_CASE("Registry.SnapshotChanges", "[registry]")
+{
+    auto registry = createRegistry();
+    auto requests = registry->getCounter("requests");
+    auto temperature = registry->getGauge("temperature", { { "room", "kitchen" } });
+    registry->getGauge("temperature", { { "room", "hall" } });
+
+    RegistrySnapshot snapshot;
+    registry->snapshot(snapshot);
+    CHECK(snapshot.size() == 3);
+    const uint64_t first = snapshot.generation();
+
+    // Nothing changed
+    registry->snapshot(snapshot, first);
+    CHECK(snapshot.groupCount() == 0);
+    CHECK(snapshot.size() == 0);
+    CHECK(snapshot.generation() > first);
+
+    // Only changed and new series are collected
+    temperature = 21.5;
+    registry->getCounter("errors");
+    registry->snapshot(snapshot, first);
+    REQUIRE(snapshot.groupCount() == 2);
+    CHECK(*snapshot.group(0).name == "errors");
+    CHECK(*snapshot.group(1).name == "temperature");
+    REQUIRE(snapshot.size() == 2);
+    CHECK(snapshot.gauge(1) == 21.5);
+    CHECK(*snapshot.labels(1).begin()->value == "kitchen");
+
+    const uint64_t second = snapshot.generation();
+    requests++;
+    registry->snapshot(snapshot, second);
+    REQUIRE(snapshot.size() == 1);
+    CHECK(snapshot.counter(0) == 1);
+
+    // Statsd serializes changes since previous call
+    uint64_t since = 0;
+    CHECK(Statsd::serialize(registry, since) == "errors|0|c\nrequests|1|c\ntemperature,room=hall|0|g\ntemperature,room=kitchen|21.5|g\n");
+    requests++;
+    CHECK(Statsd::serialize(registry, since) == "requests|2|c\n");
+    CHECK(Statsd::serialize(registry, since) == "");
+
+    // Change observed by another collector is reported to a collector which collected before it
+    RegistrySnapshot early, late;
+    late.reset();
+    early.reset();
+    registry->collect(early, 0);
+    requests++;
+    registry->collect(late, 0);
+    registry->snapshot(early, early.generation());
+    REQUIRE(early.size() == 1);
+    CHECK(early.counter(0) == 3);
+
+    // Metrics which do not track modifications are compared by value
+    class PlainGauge : public IGaugeValue
+    {
+        double m_value = 0;
+
+    public:
+        IGaugeValue& operator=(double value) override { m_value = value; return *this; }
+        IGaugeValue& operator+=(double value) override { m_value += value; return *this; }
+        IGaugeValue& operator-=(double value) override { m_value -= value; return *this; }
+        double value() const override { return m_value; }
+    };
+    auto plain = std::make_shared<PlainGauge>();
+    CHECK(plain->modificationStamp() == nullptr);
+    CHECK(requests.modificationStamp() != nullptr);
+    registry->add(std::shared_ptr<IMetric>(plain), "plain");
+    registry->snapshot(snapshot);
+    registry->snapshot(snapshot, snapshot.generation());
+    CHECK(snapshot.size() == 0);
+    *plain = 3;
+    registry->snapshot(snapshot, snapshot.generation());
+    REQUIRE(snapshot.size() == 1);
+    CHECK(snapshot.gauge(0) == 3);
+
+    // Changes observed by expiry in between are reported
+    RegistryOptions options;
+    options.expireAfter = std::chrono::hours(1);
+    auto expiring = createRegistry(options);
+    auto active = expiring->getCounter("active");
+    expiring->getCounter("idle");
+    for (int expiries : { 1, 8 }) {
+        expiring->snapshot(snapshot);
+        active++;
+        for (int i = 0; i < expiries; i++)
+            expiring->expire();
+        expiring->snapshot(snapshot, snapshot.generation());
+        REQUIRE(snapshot.size() == 1);
+        CHECK(*snapshot.group(0).name == "active");
+    }
+}
+
+TEST_CASE("Registry.View", "[registry]")
+{
+    auto registry = createRegistry();
+    auto billing = createRegistryView(registry, "billing_", { { "service", "billing" }, { "zone", "eu" } });
+    billing->getCounter("requests", { { "status", "200" } }) += 2;
+    billing->setDescription("requests", "Handled requests");
+
+    // Series are stored without constant labels, and looked up by own names
+    CHECK(registry->getCounter("requests", { { "status", "200" } }).value() == 2);
+    CHECK(billing->metricNames() == vector<string>{ "requests" });
+    CHECK(billing->size() == 1);
+
+    CHECK(Prometheus::serialize(billing) ==
+        "# HELP billing_requests Handled requests\n"
+        "# TYPE billing_requests counter\n"
+        "billing_requests{service=\"billing\",zone=\"eu\",status=\"200\"} 2\n");
+    CHECK(Statsd::serialize(billing) == "billing_requests,service=billing,zone=eu,status=200|2|c\n");
+
+    // Views of views combine prefixes and labels
+    auto nested = createRegistryView(billing, "app_", { { "pod", "1" } });
+    RegistrySnapshot snapshot;
+    nested->snapshot(snapshot);
+    REQUIRE(snapshot.groupCount() == 1);
+    CHECK(*snapshot.group(0).prefix == "app_billing_");
+    CHECK(snapshot.group(0).labels().size() == 3);
+
+    // Series labels shadow constant labels with the same name
+    auto search = createRegistry();
+    search->getCounter("requests", { { "service", "search" } })++;
+    auto shadowed = createRegistryView(search, "", { { "service", "billing" }, { "zone", "eu" } });
+    CHECK(Prometheus::serialize(shadowed) == "# TYPE requests counter\nrequests{zone=\"eu\",service=\"search\"} 1\n");
+    CHECK(Statsd::serialize(shadowed) == "requests,zone=eu,service=search|1|c\n");
+
+    // Shadowed labels do not make series of a composite distinct
+    auto composite = createCompositeRegistry({ shadowed, createRegistryView(search, "", { { "zone", "eu" } }) });
+    RegistrySnapshot merged;
+    composite->snapshot(merged);
+    CHECK(merged.size() == 1);
+}
+
+TEST_CASE("Registry.Composite", "[registry]")
+{
+    auto first = createRegistry();
+    auto second = createRegistry();
+    first->getGauge("b_temperature") = 20;
+    second->getGauge("b_temperature", { { "room", "hall" } }) = 18;
+    second->getCounter("a_requests")++;
+    auto composite = createCompositeRegistry({ createRegistryView(first, "", { { "source", "first" } }), second });
+
+    CHECK(composite->size() == 3);
+    CHECK(composite->metricNames() == vector<string>{ "a_requests", "b_temperature" });
+    CHECK(composite->getGroup("a_requests").metrics().size() == 1);
+    CHECK(Prometheus::serialize(composite) ==
+        "# TYPE a_requests counter\n"
+        "a_requests 1\n"
+        "# TYPE b_temperature gauge\n"
+        "b_temperature{source=\"first\"} 20\n"
+        "b_temperature{room=\"hall\"} 18\n");
+
+    // Changes are collected across registries
+    RegistrySnapshot snapshot;
+    composite->snapshot(snapshot);
+    second->getCounter("a_requests")++;
+    composite->snapshot(snapshot, snapshot.generation());
+    REQUIRE(snapshot.size() == 1);
+    CHECK(snapshot.counter(0) == 2);
+
+    CHECK_THROWS_AS(composite->getCounter("a_requests"), logic_error);
+    CHECK_THROWS_AS(composite->remove("a_requests"), logic_error);
+    CHECK_THROWS_AS(createCompositeRegistry({ nullptr }), logic_error);
+
+    // Groups of a different type than the first registry's and repeated label sets are dropped
+    auto third = createRegistry();
+    third->getGauge("a_requests") = 5;
+    third->getCounter("b_temperature", { { "room", "cellar" } });
+    auto fourth = createRegistry();
+    fourth->getGauge("b_temperature") = 30;
+    fourth->getGauge("b_temperature", { { "room", "attic" } }) = 25;
+    auto conflicting = createCompositeRegistry({ composite, third, createRegistryView(fourth, "", { { "source", "first" } }) });
+    CHECK(Prometheus::serialize(conflicting) ==
+        "# TYPE a_requests counter\n"
+        "a_requests 2\n"
+        "# TYPE b_temperature gauge\n"
+        "b_temperature{source=\"first\"} 20\n"
+        "b_temperature{room=\"hall\"} 18\n"
+        "b_temperature{source=\"first\",room=\"attic\"} 25\n");
+    conflicting->snapshot(snapshot);
+    CHECK(snapshot.groupCount() == 4);
+    CHECK(snapshot.size() == 4);
+}
+
+TEST_CASE("Registry.ConcurrentLookup", "[registry]")
+{
+    auto registry = createRegistry();
+
+    // Creates and looks up series from several threads while index grows
+    vector<thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([registry]() {
+            for (int i = 0; i < 1000; i++)
+                registry->getCounter("lookup", { { "series", std::to_string(i) } })++;
+        });
+    }
+    for (auto& t : threads)
+        t.join();
+
+    CHECK(registry->size() == 1000);
+    for (int i = 0; i < 1000; i++)
+        REQUIRE(registry->getCounter("lookup", { { "series", std::to_string(i) } }).value() == 4);
+
+    // Series added directly are found by lookups
+    auto gauge = Gauge();
+    registry->add(gauge, "added");
+    gauge = 5;
+    CHECK(registry->getGauge("added").value() == 5.);
+    CHECK_THROWS_AS(registry->getCounter("added"), logic_error);
+}
+
 TEST_CASE("Timer.Counter", "[timer][counter]")
 {
     Counter c;
@@ -183,6 +1192,21 @@ TEST_CASE("Timer.Histogram", "[timer][histogram]")
     CHECK(values[1].second == 1);
 }
 
+TEST_CASE("Timer.IntegerHistogram", "[timer][histogram]")
+{
+    Histogram h(makeIntegerHistogram({ 1000000, 1000000000 }, 1e-9));
+    {
+        Timer<nanoseconds> t(h);
+        sleep_for(2ms);
+    }
+    CHECK(h.sum() > 0.002);
+    CHECK(h.sum() < 1);
+    CHECK(h.count() == 1);
+    auto values = h.values();
+    CHECK(values[0].second == 0);
+    CHECK(values[1].second == 1);
+}
+
 TEST_CASE("Timer.Summary", "[timer][summary]")
 {
     Summary s({ .5, .9, .99 });